@@ -0,0 +1,321 @@
+// ISO C++14 Standard
+//
+// Compile-time evaluation of simple_eval expressions.
+//
+//   constexpr double v = simple_eval::evaluate("(1+2)*3/4");
+//
+// The grammar and the order of floating point operations are the same as
+// in the runtime tokenizer / eval: + - * / and brackets, left associative,
+// unary + and - not supported, blanks are ignored everywhere (also inside
+// numbers), and number text is converted like atof() does.
+//
+// A syntax error in a constant evaluation is a compile error (the parser
+// calls the non-constexpr invalid_expression()). Called at run time the
+// same function returns NaN for a syntax error.
+//
+// Number literals are correctly rounded like atof(): short literals take
+// the exact double path, longer ones are corrected with a big integer
+// comparison against the neighbouring halfway points.
+//
+// Known differences from the runtime path:
+//  - variable names are not supported, they are a syntax error;
+//  - an overflow, a division by zero or a NaN result is not a constant
+//    expression, so it is a compile error instead of inf / NaN;
+//  - literals with more than 300 significant digits or with a value
+//    outside 1e-290 .. 1e300 are not corrected and may differ from atof()
+//    in the last bit.
+//  - the runtime evaluates integer programs without division exactly in
+//    64-bit integers (see compile_options::integer), here they are double
+//    arithmetic; the results differ when an intermediate value is above
+//    2^53, and a zero result is never -0 at run time.
+
+#ifndef SIMPLE_EVAL_CONSTEXPR_EVAL_H
+#define SIMPLE_EVAL_CONSTEXPR_EVAL_H
+
+#include <limits>
+
+namespace simple_eval {
+namespace detail {
+
+// not constexpr on purpose: reaching it in a constant evaluation
+// turns a syntax error into a compile error
+inline double invalid_expression() {
+	return std::numeric_limits<double>::quiet_NaN();
+}
+
+constexpr double pow10(int n) {
+	double p = 1.0;
+	for (int i = 0; i < n; ++i) p *= 10.0;
+	return p;
+}
+
+// unsigned big integer, enough bits to compare a literal with a double
+class big_uint {
+private:
+	static constexpr int size = 128;
+	unsigned limb[size];
+	int used;
+public:
+	constexpr big_uint() : limb{}, used{} {}
+	constexpr big_uint(unsigned long long v) : limb{}, used{} {
+		while (v != 0) {
+			limb[used++] = (unsigned)(v & 0xffffffffu);
+			v >>= 32;
+		}
+	}
+	constexpr void mul_add(unsigned m, unsigned a) {
+		unsigned long long carry = a;
+		for (int i = 0; i < used; ++i) {
+			unsigned long long t = (unsigned long long)limb[i] * m + carry;
+			limb[i] = (unsigned)(t & 0xffffffffu);
+			carry = t >> 32;
+		}
+		if (carry != 0 && used < size) limb[used++] = (unsigned)carry;
+	}
+	constexpr void mul_pow10(int n) {
+		for (; n >= 9; n -= 9) mul_add(1000000000u, 0);
+		for (; n > 0; --n) mul_add(10u, 0);
+	}
+	constexpr void shift_left(int bits) {
+		int words = bits / 32;
+		bits %= 32;
+		if (used == 0) return;
+		int n = used + words + 1;
+		if (n > size) n = size;
+		for (int i = n - 1; i >= 0; --i) {
+			int src = i - words;
+			unsigned hi = (src >= 0 && src < used) ? limb[src] : 0;
+			unsigned lo = (src - 1 >= 0 && src - 1 < used) ? limb[src - 1] : 0;
+			limb[i] = bits == 0 ? hi : ((hi << bits) | (lo >> (32 - bits)));
+		}
+		used = n;
+		while (used > 0 && limb[used - 1] == 0) --used;
+	}
+	constexpr int compare(const big_uint& b) const {
+		int n = used > b.used ? used : b.used;
+		for (int i = n - 1; i >= 0; --i) {
+			unsigned x = i < used ? limb[i] : 0;
+			unsigned y = i < b.used ? b.limb[i] : 0;
+			if (x != y) return x < y ? -1 : 1;
+		}
+		return 0;
+	}
+};
+
+constexpr double pow2(int n) {
+	double p = 1.0;
+	for (; n > 0; --n) p *= 2.0;
+	for (; n < 0; ++n) p *= 0.5;
+	return p;
+}
+
+// compares digits * 10^-scale with h * 2^e
+constexpr int compare_halfway(big_uint digits, int scale,
+	unsigned long long h, int e) {
+	big_uint x{ h };
+	x.mul_pow10(scale);
+	if (e < 0) digits.shift_left(-e);
+	else x.shift_left(e);
+	return digits.compare(x);
+}
+
+// rounds an approximation of digits * 10^-scale to the nearest double
+constexpr double correct_rounding(double approx, const big_uint& digits,
+	int scale) {
+	if (not (approx > 1e-290 && approx < 1e300)) return approx;
+	double b = approx;
+	for (int step = 0; step < 8; ++step) {
+		// b = m * 2^e with 2^52 <= m < 2^53
+		int e = 0;
+		double f = b;
+		while (f >= 9007199254740992.0) {
+			f *= 0.5;
+			++e;
+		}
+		while (f < 4503599627370496.0) {
+			f *= 2.0;
+			--e;
+		}
+		unsigned long long m = (unsigned long long)f;
+		// halfway points to the neighbours, in units of 2^(e-2)
+		unsigned long long up = 4 * m + 2;
+		unsigned long long down = (m == (1ULL << 52)) ? 4 * m - 1 : 4 * m - 2;
+		int c = compare_halfway(digits, scale, up, e - 2);
+		if (c > 0 || (c == 0 && (m & 1) != 0)) {
+			b = (double)(m + 1) * pow2(e);
+			continue;
+		}
+		c = compare_halfway(digits, scale, down, e - 2);
+		if (c < 0 || (c == 0 && (m & 1) != 0)) {
+			b = (m == (1ULL << 52)) ? (double)(2 * m - 1) * pow2(e - 1) :
+				(double)(m - 1) * pow2(e);
+			continue;
+		}
+		break;
+	}
+	return b;
+}
+
+class parser {
+private:
+	const char* src;
+	int pos;
+	bool error;
+
+	constexpr static bool is_space(char c) {
+		return c == ' ' || c == '\t' || c == '\n' || c == '\v' ||
+			c == '\f' || c == '\r';
+	}
+	constexpr static bool is_digit(char c) {
+		return c >= '0' && c <= '9';
+	}
+	constexpr static bool is_value(char c) {
+		return is_digit(c) || c == '.';
+	}
+	constexpr char peek() {
+		while (is_space(src[pos])) ++pos;
+		return src[pos];
+	}
+	constexpr double number();
+	constexpr double factor();
+	constexpr double term();
+	constexpr double expression();
+public:
+	constexpr parser(const char* s) : src{ s }, pos{}, error{} {}
+	constexpr double parse();
+};
+
+// reads number text like the tokenizer (blanks skipped) and
+// converts it like atof(): digits, optional '.', digits
+constexpr double parser::number() {
+	unsigned long long mantissa = 0;
+	big_uint all{};       // all significant digits
+	int total = 0;        // significant digits in all
+	int digits = 0;       // significant digits in mantissa
+	int scale = 0;        // decimal places in mantissa
+	int all_scale = 0;    // decimal places in all
+	int dropped = 0;      // integer digits that did not fit
+	bool exact = true;
+	bool dot = false;
+	bool done = false;    // atof stops at the second '.'
+	while (is_value(peek())) {
+		char c = src[pos++];
+		if (done) continue;
+		if (c == '.') {
+			if (dot) done = true;
+			dot = true;
+			continue;
+		}
+		if (total < 300) {
+			all.mul_add(10u, (unsigned)(c - '0'));
+			if (total > 0 || c != '0') ++total;
+			if (dot) ++all_scale;
+		}
+		else if (dot) continue;
+		else {
+			all.mul_add(10u, 0);
+			++total;
+		}
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (unsigned long long)(c - '0');
+			if (mantissa != 0) ++digits;
+			if (dot) ++scale;
+		}
+		else {
+			exact = false;
+			if (not dot) ++dropped;
+		}
+	}
+	if (mantissa > (1ULL << 53) || scale > 22) exact = false;
+	double value = (double)mantissa;
+	if (dropped > 0) value *= pow10(dropped);
+	if (scale > 0) {
+		if (exact) value /= pow10(scale);
+		else {
+			while (scale > 22) {
+				value /= 1e22;
+				scale -= 22;
+			}
+			value /= pow10(scale);
+		}
+	}
+	if (not exact && total <= 300)
+		value = correct_rounding(value, all, all_scale);
+	return value;
+}
+
+constexpr double parser::factor() {
+	char c = peek();
+	if (c == '(') {
+		++pos;
+		double value = expression();
+		if (peek() != ')') {
+			error = true;
+			return 0;
+		}
+		++pos;
+		return value;
+	}
+	if (is_value(c)) return number();
+	error = true;
+	return 0;
+}
+
+constexpr double parser::term() {
+	double x = factor();
+	while (not error) {
+		char c = peek();
+		if (c == '*') {
+			++pos;
+			double y = factor();
+			if (error) break;
+			x = x * y;
+		}
+		else if (c == '/') {
+			++pos;
+			double y = factor();
+			if (error) break;
+			x = x / y;
+		}
+		else break;
+	}
+	return x;
+}
+
+constexpr double parser::expression() {
+	double x = term();
+	while (not error) {
+		char c = peek();
+		if (c == '+') {
+			++pos;
+			double y = term();
+			if (error) break;
+			x = x + y;
+		}
+		else if (c == '-') {
+			++pos;
+			double y = term();
+			if (error) break;
+			x = x - y;
+		}
+		else break;
+	}
+	return x;
+}
+
+constexpr double parser::parse() {
+	double value = expression();
+	if (peek() != '\0') error = true;
+	if (error) return invalid_expression();
+	return value;
+}
+
+} // namespace detail
+
+constexpr double evaluate(const char* expr) {
+	return detail::parser(expr).parse();
+}
+
+} // namespace simple_eval
+
+#endif
@@ -0,0 +1,141 @@
+// ISO C++14 Standard
+//
+// Expression templates for formulas known at build time.
+//
+//   using namespace simple_eval::et;
+//   constexpr auto f = (lit(1) + 2) * 3 / 4;
+//   double v = f.eval();
+//
+//   // variables read values[] by slot, as program::run() does
+//   auto g = var(0) * 2 + var(1);
+//   double w = g.eval(values);
+//
+// The operators mirror the runtime token_type operators (+ - * /) and a
+// formula builds the same tree as the runtime parser builds for the same
+// text, so every node performs the same IEEE operation in the same order
+// and the result is bit-identical to tokenizer / eval, which
+// tests/expr_template.cpp checks. The exception is the exact integer path
+// of eval: integer programs without division are computed in 64-bit
+// integers, so they differ above 2^53 (see constexpr_eval.h) and never
+// give -0. Plain double operands are taken as literals.
+//
+// Build the engine and the code using the templates with
+// -ffp-contract=off. GCC contracts across statements in GNU mode (its
+// default) and Clang defaults to -ffp-contract=on, which fuses x * y + z
+// written in one expression; a fused multiply-add rounds once and differs
+// from the engine. tests/Makefile builds with the option.
+
+#ifndef SIMPLE_EVAL_EXPR_TEMPLATE_H
+#define SIMPLE_EVAL_EXPR_TEMPLATE_H
+
+#include <type_traits>
+
+namespace simple_eval {
+namespace et {
+
+// base of all expression nodes
+template <class E>
+class expression {
+public:
+	constexpr const E& self() const { return static_cast<const E&>(*this); }
+};
+
+class literal : public expression<literal> {
+private:
+	double value;
+public:
+	constexpr explicit literal(double v) : value{ v } {}
+	constexpr double eval(const double* = nullptr) const { return value; }
+};
+
+class add_op {
+public:
+	static constexpr double apply(double x, double y) { return x + y; }
+};
+class sub_op {
+public:
+	static constexpr double apply(double x, double y) { return x - y; }
+};
+class mul_op {
+public:
+	static constexpr double apply(double x, double y) { return x * y; }
+};
+class div_op {
+public:
+	static constexpr double apply(double x, double y) { return x / y; }
+};
+
+// variable bound to a program slot
+class variable : public expression<variable> {
+private:
+	unsigned slot;
+public:
+	constexpr explicit variable(unsigned s) : slot{ s } {}
+	constexpr double eval(const double* values) const { return values[slot]; }
+};
+
+template <class Op, class L, class R>
+class binary : public expression<binary<Op, L, R>> {
+private:
+	L left;
+	R right;
+public:
+	constexpr binary(const L& l, const R& r) : left{ l }, right{ r } {}
+	constexpr double eval(const double* values = nullptr) const {
+		return Op::apply(left.eval(values), right.eval(values));
+	}
+};
+
+constexpr literal lit(double v) { return literal{ v }; }
+constexpr variable var(unsigned slot) { return variable{ slot }; }
+
+namespace detail {
+
+template <class T>
+using is_node = std::is_base_of<expression<T>, T>;
+
+template <class T>
+constexpr const T& node(const expression<T>& e) { return e.self(); }
+constexpr literal node(double v) { return literal{ v }; }
+
+template <class T>
+using node_type = typename std::conditional<std::is_arithmetic<T>::value,
+	literal, T>::type;
+
+// at least one operand must be an expression node
+template <class L, class R>
+using enable_binary = typename std::enable_if<
+	(is_node<L>::value && (is_node<R>::value || std::is_arithmetic<R>::value)) ||
+	(std::is_arithmetic<L>::value && is_node<R>::value)>::type;
+
+template <class Op, class L, class R>
+constexpr binary<Op, node_type<L>, node_type<R>> make(const L& l, const R& r) {
+	return binary<Op, node_type<L>, node_type<R>>{ node(l), node(r) };
+}
+
+} // namespace detail
+
+template <class L, class R, class = detail::enable_binary<L, R>>
+constexpr auto operator+(const L& l, const R& r) {
+	return detail::make<add_op>(l, r);
+}
+
+template <class L, class R, class = detail::enable_binary<L, R>>
+constexpr auto operator-(const L& l, const R& r) {
+	return detail::make<sub_op>(l, r);
+}
+
+template <class L, class R, class = detail::enable_binary<L, R>>
+constexpr auto operator*(const L& l, const R& r) {
+	return detail::make<mul_op>(l, r);
+}
+
+template <class L, class R, class = detail::enable_binary<L, R>>
+constexpr auto operator/(const L& l, const R& r) {
+	return detail::make<div_op>(l, r);
+}
+
+} // namespace et
+} // namespace simple_eval
+
+#endif
@@ -4,6 +4,38 @@
 #include <string>
 #include <vector>
 #include <stack>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <deque>
+#include <functional>
+#include <tuple>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMPLE_EVAL_X86
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -12,6 +44,7 @@ const char* VERSION{ "0.1" };
 enum class token_type {
 	unknown,
 	number,
+	identifier,      // variable name
 	open_bracket,    // (
 	close_bracket,   // )
 	op_add,          // +
@@ -35,42 +68,143 @@ public:
 
 using token_list = vector<token>;
 
+// number literals of an expression in text order, the constants of
+// every program compiled from an expression of the same shape
+class literal_values {
+public:
+	vector<double> constants{};
+	// integer literals, complete when all literals are integers
+	vector<long long> int_constants{};
+};
+
+// literal text of a 64-bit integer
+bool integer_literal(const string& text, long long& value) {
+	if (text.empty() || text.size() > 19) return false;
+	for (char c : text)
+		if (not isdigit(c)) return false;
+	errno = 0;
+	value = strtoll(text.c_str(), nullptr, 10);
+	return errno == 0;
+}
+
+const unsigned long long fnv_offset = 14695981039346656037ULL;
+const unsigned long long fnv_prime = 1099511628211ULL;
+
+// tokens of an expression without the literal values, see program_cache
+class expression_shape {
+public:
+	// operators and names (a blank after each), # for an integer
+	// literal, $ for another number
+	string text{};
+	// FNV-1a hash of text
+	unsigned long long hash{ fnv_offset };
+	// the literals in token order
+	literal_values literals{};
+
+	void clear();
+	void add(const token& t);
+};
+
+void expression_shape::clear() {
+	text.clear();
+	hash = fnv_offset;
+	literals.constants.clear();
+	literals.int_constants.clear();
+}
+
+void expression_shape::add(const token& t) {
+	size_t from = text.size();
+	if (t.type == token_type::number) {
+		long long value{};
+		bool integer = integer_literal(t.text, value);
+		if (integer) literals.int_constants.push_back(value);
+		literals.constants.push_back(t.number);
+		text += integer ? '#' : '$';
+	}
+	else {
+		text += t.text;
+		if (t.type == token_type::identifier) text += ' ';
+	}
+	for (size_t i = from; i < text.size(); ++i)
+		hash = (hash ^ (unsigned char)text[i]) * fnv_prime;
+}
+
 class tokenizer {
 private:
 	string src;
 	token_list tokens;
 	bool error;
+	expression_shape shape;
 	bool is_value(char c);
+	bool is_name(char c);
+	bool is_name_start(char c);
 	bool is_operator(char c);
+	void push_token(token& t);
 	void verify_tokenlist();
 public:
 	tokenizer(const string &src_text);
+	// starts over with new text, keeps allocated memory
+	void reset(const string &src_text);
 	void parse();
+	// reads the tokens without checking their order, for pieces of text
+	void lex();
+	// operands and operators alternate, brackets match
+	static bool valid(const token_list& tokens);
 	bool error_state();
 	token_list get_tokens() const;
+	const token_list& tokens_ref() const;
+	// shape of the tokens in text order, computed while parsing
+	const expression_shape& get_shape() const;
 };
 
 tokenizer::tokenizer(const string &src_text)
-	: src{ src_text }, tokens{}, error{} {}
+	: src{ src_text }, tokens{}, error{}, shape{} {}
+
+void tokenizer::reset(const string &src_text) {
+	src = src_text;
+	tokens.clear();
+	error = false;
+	shape.clear();
+}
 
 bool tokenizer::is_value(char c) {
 	return isdigit(c) || (c == '.');
 }
+bool tokenizer::is_name(char c) {
+	return isalnum(c) || (c == '_');
+}
+bool tokenizer::is_name_start(char c) {
+	return isalpha(c) || (c == '_');
+}
 bool tokenizer::is_operator(char c) {
 	return (c == '+') || (c == '-') || (c == '*') || (c == '/') ||
 		(c == '(') || (c == ')');
 }
 
 void tokenizer::verify_tokenlist() {
-	if (error) return;
-	// verify if no parsing error
+	if (not error && not valid(tokens)) error = true;
+}
+
+bool tokenizer::valid(const token_list& tokens) {
+	bool ok = true;
 	int numbers_count = 0;
 	int operations_count = 0;
 	int open_brackets_count = 0;
 	int close_brackets_count = 0;
-	for (token t : tokens) {
+	// an operand is expected at the start, after an operator and after
+	// an open bracket, otherwise an operator or a close bracket
+	bool operand_expected = true;
+	for (const token& t : tokens) {
+		bool operand = (t.type == token_type::number) ||
+			(t.type == token_type::identifier) ||
+			(t.type == token_type::open_bracket);
+		if (operand != operand_expected) ok = false;
+		operand_expected = (t.type != token_type::number) &&
+			(t.type != token_type::identifier) &&
+			(t.type != token_type::close_bracket);
 		switch (t.type) {
 			case token_type::number:
+			case token_type::identifier:
 				++numbers_count;
 				break;
 			case token_type::open_bracket:
@@ -86,32 +220,54 @@ void tokenizer::verify_tokenlist() {
 				++operations_count;
 				break;
 			default:
-				error = true;
+				ok = false;
 				break;
 		}
+		// a close bracket without an open one
+		if (open_brackets_count < close_brackets_count) ok = false;
+	}
+	if (operand_expected) ok = false;
+	if (open_brackets_count != close_brackets_count) ok = false;
+	if (numbers_count != operations_count + 1) ok = false;
+	return ok;
+}
+
+void tokenizer::push_token(token& t) {
+	if (t.type != token_type::unknown) {
+		if (t.type == token_type::number)
+			t.number = atof(t.text.c_str());
+		shape.add(t);
+		tokens.push_back(t);
 	}
-	if (open_brackets_count != close_brackets_count) error = true;
-	if (numbers_count != operations_count + 1) error = true;
+	t.clear();
 }
 
 void tokenizer::parse() {
+	lex();
+	verify_tokenlist();
+}
+
+void tokenizer::lex() {
 	token t{};
 
 	// read tokens
 	for (char rune : src) {
-		if (isspace(rune)) continue;
-		if (is_value(rune)) {
-			t.type = token_type::number;
+		if (isspace(rune)) {
+			// blanks end a name, numbers may contain blanks
+			if (t.type == token_type::identifier) push_token(t);
+			continue;
+		}
+		if (is_value(rune) || is_name(rune)) {
+			token_type type = token_type::number;
+			if (t.type == token_type::identifier ? is_name(rune) : is_name_start(rune))
+				type = token_type::identifier;
+			if (t.type != type) push_token(t);
+			t.type = type;
 			t.text += rune;
 			continue;
 		}
 		if (is_operator(rune)) {
-			if (t.type != token_type::unknown) {
-				if(t.type == token_type::number)
-					t.number = atof(t.text.c_str());
-				tokens.push_back(t);
-			}
-			t.clear();
+			push_token(t);
 			if (rune == '+') t.type = token_type::op_add;
 			if (rune == '-') t.type = token_type::op_sub;
 			if (rune == '*') t.type = token_type::op_mul;
@@ -119,6 +275,7 @@ void tokenizer::parse() {
 			if (rune == '(') t.type = token_type::open_bracket;
 			if (rune == ')') t.type = token_type::close_bracket;
 			t.text.append(1, rune);
+			shape.add(t);
 			tokens.push_back(t);
 			t.clear();
 			continue;
@@ -126,267 +283,5380 @@ void tokenizer::parse() {
 		error = true;
 		break;
 	}
-	if (t.type != token_type::unknown) {
-		if (t.type == token_type::number)
-			t.number = atof(t.text.c_str());
-		tokens.push_back(t);
-	}
-	verify_tokenlist();
+	push_token(t);
 }
 
 bool tokenizer::error_state() { return error;  }
 token_list tokenizer::get_tokens() const { return tokens; }
+const token_list& tokenizer::tokens_ref() const { return tokens; }
+const expression_shape& tokenizer::get_shape() const { return shape; }
 
-class eval {
+/*  ~ Work stealing thread pool ~
+
+	Every worker owns a task deque. A worker pops its own newest task
+	first (LIFO, hot in cache) and when its deque is empty steals the
+	oldest task of another worker (FIFO, usually the biggest piece of
+	work). Tasks submitted from a worker go to its own deque, others are
+	spread round robin. Threads waiting for a task_group run pending
+	tasks instead of blocking, so tasks may fork and join recursively. */
+
+class thread_pool {
 private:
-	token_list tokens;
-	bool error;
-	double result;
-	// returns operator precedence
-	int precedence(const token& tk);
-	bool is_number(const token& tk);
-	bool is_operator(const token& tk);
-	bool is_bracket(const token& tk);
-	bool is_open_bracket(const token& tk);
-	bool is_close_bracket(const token& tk);
-	// returns true if bracket is found
-	bool check_infix_for_brackets(const token_list& tl);
-	// reorder tokens to postfix notation
-	void to_postfix();
+	class task_queue {
+	public:
+		mutex lock;
+		deque<function<void()>> tasks;
+	};
+	vector<unique_ptr<task_queue>> queues;
+	vector<thread> threads;
+	atomic<bool> stopping;
+	atomic<size_t> queued;
+	atomic<size_t> next_queue;
+	mutex sleep_lock;
+	condition_variable wake;
+	static thread_local const thread_pool* current_pool;
+	static thread_local int current_index;
+	bool pop(size_t index, function<void()>& task);
+	bool steal(size_t index, function<void()>& task);
+	void worker(size_t index);
 public:
-	eval(const tokenizer& t);
-	eval(const token_list& t);
-	bool error_state();
-	token_list get_tokens() const;
-	double get_result();
-	void solve();
+	// 0 threads means one per hardware thread
+	thread_pool(size_t threads = 0);
+	~thread_pool();
+	size_t size() const;
+	void submit(function<void()> task);
+	// runs one pending task, false if there was none
+	bool run_one();
+	// index of the calling worker of this pool, -1 for other threads
+	int worker_index() const;
 };
 
-eval::eval(const tokenizer& tk)
-	: tokens{ tk.get_tokens() }, error{}, result{} {}
+thread_local const thread_pool* thread_pool::current_pool{};
+thread_local int thread_pool::current_index{ -1 };
 
-eval::eval(const token_list& t):
-	tokens{ t }, error{}, result{} {}
+thread_pool::thread_pool(size_t n)
+	: queues{}, threads{}, stopping{ false }, queued{ 0 }, next_queue{ 0 } {
+	if (n == 0) n = max(1u, thread::hardware_concurrency());
+	for (size_t i = 0; i < n; ++i) queues.emplace_back(new task_queue());
+	for (size_t i = 0; i < n; ++i) threads.emplace_back(&thread_pool::worker, this, i);
+}
 
-token_list eval::get_tokens() const { return tokens; }
-bool eval::error_state() { return error; }
-double eval::get_result() { return result; }
+thread_pool::~thread_pool() {
+	{
+		lock_guard<mutex> g(sleep_lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (thread& t : threads) t.join();
+}
 
-int eval::precedence(const token& tk) {
-	int precedence = -1;
-	switch(tk.type) {
-		case token_type::op_add:
-		case token_type::op_sub:
-			precedence = 10;
-			break;
-		case token_type::op_mul:
-		case token_type::op_div:
-			precedence = 20;
-			break;
+size_t thread_pool::size() const { return threads.size(); }
+
+int thread_pool::worker_index() const {
+	return current_pool == this ? current_index : -1;
+}
+
+void thread_pool::submit(function<void()> task) {
+	int self = worker_index();
+	size_t index = self >= 0 ? (size_t)self : next_queue++ % queues.size();
+	{
+		lock_guard<mutex> g(queues[index]->lock);
+		queues[index]->tasks.push_back(move(task));
 	}
-	return precedence;
+	{
+		lock_guard<mutex> g(sleep_lock);
+		++queued;
+	}
+	wake.notify_one();
 }
 
-bool eval::is_number(const token& tk) {
-	return (tk.type == token_type::number);
+bool thread_pool::pop(size_t index, function<void()>& task) {
+	task_queue& q = *queues[index];
+	lock_guard<mutex> g(q.lock);
+	if (q.tasks.empty()) return false;
+	task = move(q.tasks.back());
+	q.tasks.pop_back();
+	--queued;
+	return true;
 }
 
-bool eval::is_operator(const token& tk) {
-	if(tk.type == token_type::op_add) return true;
-	if(tk.type == token_type::op_sub) return true;
-	if(tk.type == token_type::op_mul) return true;
-	if(tk.type == token_type::op_div) return true;
+bool thread_pool::steal(size_t index, function<void()>& task) {
+	for (size_t i = 1; i <= queues.size(); ++i) {
+		task_queue& q = *queues[(index + i) % queues.size()];
+		lock_guard<mutex> g(q.lock);
+		if (q.tasks.empty()) continue;
+		task = move(q.tasks.front());
+		q.tasks.pop_front();
+		--queued;
+		return true;
+	}
 	return false;
 }
 
-bool eval::is_bracket(const token& tk) {
-	if (is_open_bracket(tk)) return true;
-	if (is_close_bracket(tk)) return true;
+bool thread_pool::run_one() {
+	if (queued == 0) return false;
+	function<void()> task;
+	int self = worker_index();
+	size_t index = self >= 0 ? (size_t)self : 0;
+	if ((self >= 0 && pop(index, task)) || steal(index, task)) {
+		task();
+		return true;
+	}
 	return false;
 }
 
-bool eval::is_open_bracket(const token& tk) {
-	return (tk.type == token_type::open_bracket);
+void thread_pool::worker(size_t index) {
+	current_pool = this;
+	current_index = (int)index;
+	function<void()> task;
+	for (;;) {
+		if (pop(index, task) || steal(index, task)) {
+			task();
+			task = nullptr;
+			continue;
+		}
+		unique_lock<mutex> g(sleep_lock);
+		wake.wait(g, [this] { return stopping || queued > 0; });
+		if (stopping && queued == 0) return;
+	}
 }
 
-bool eval::is_close_bracket(const token& tk) {
-	return (tk.type == token_type::close_bracket);
+// fork-join: runs tasks on a pool and waits for all of them
+class task_group {
+private:
+	thread_pool& pool;
+	atomic<size_t> pending;
+public:
+	task_group(thread_pool& p);
+	~task_group();
+	void run(function<void()> task);
+	// helps the pool until all tasks of the group are done
+	void wait();
+};
+
+task_group::task_group(thread_pool& p) : pool(p), pending{ 0 } {}
+
+task_group::~task_group() { wait(); }
+
+void task_group::run(function<void()> task) {
+	++pending;
+	pool.submit([this, task] {
+		task();
+		--pending;
+	});
 }
 
-/*  ~ The Shunting Yard Algorithm ~
+void task_group::wait() {
+	while (pending > 0)
+		if (not pool.run_one()) this_thread::yield();
+}
 
-       While there are tokens to be read:
-       Read a token
-       If it's a number add it to queue
-       If it's an operator
-              While there's an operator on the top of the stack with greater precedence:
-                      Pop operators from the stack onto the output queue
-              Push the current operator onto the stack
-       If it's a left bracket push it onto the stack
-       If it's a right bracket 
-            While there's not a left bracket at the top of the stack:
-				Pop operators from the stack onto the output queue.
-             Pop the left bracket from the stack and discard it
-	While there are operators on the stack, pop them to the queue */
+// pool for parallel work inside one evaluation, started on first use
+thread_pool& shared_pool() {
+	static thread_pool pool;
+	return pool;
+}
 
-void eval::to_postfix() {
-	// input in infix notation
-	token_list input { tokens };
-	// output in postfix notation
-	token_list output {};
-	// stack of operators
-	stack<token, token_list> op_stack{};
+// bytecode of compiled expressions
+enum class opcode : unsigned char {
+	push,            // push constant
+	load,            // push variable
+	add,
+	sub,
+	mul,
+	div,
+	// superinstructions, fused by compiler::fuse()
+	add_const,       // push c; add
+	sub_const,       // push c; sub
+	mul_const,       // push c; mul
+	div_const,       // push c; div
+	add_add,         // add; add  -> x + (y + z)
+	mul_mul,         // mul; mul  -> x * (y * z)
+	mul_add,         // mul; add  -> x + y * z
+	mul_sub,         // mul; sub  -> x - y * z
+	add_var,         // load v; add
+	sub_var,         // load v; sub
+	mul_var,         // load v; mul
+	div_var,         // load v; div
+	add_vars,        // load a; load b; add
+	sub_vars,        // load a; load b; sub
+	mul_vars,        // load a; load b; mul
+	div_vars,        // load a; load b; div
+	// chains of one operator, see compiler::reassociate()
+	reduce_add,      // pairwise sum of the top arg values
+	reduce_mul       // pairwise product of the top arg values
+};
 
-	// we reading token list from left to right
-	for (token term : input) {
-		// current token is the number
-		if (is_number(term)) {
-			output.push_back(term);
-			continue;
-		}
-		// current token is the operator
-		if (is_operator(term)) {
-			// if the stack is empty
-			if (op_stack.empty()) {
-				op_stack.push(term);
-				continue;
-			}
-			// if there are brackets on the top of the stack
-			if (is_bracket(op_stack.top())) {
-				op_stack.push(term);
-				continue;
-			}
-			// checking operators priority
-			if (precedence(term) > precedence(op_stack.top())) {
-				op_stack.push(term);
-			} 
-			else {
-				while (not op_stack.empty()) {
-					output.push_back(op_stack.top());
-					op_stack.pop();
-				}
-				op_stack.push(term);
-			}
-			continue;
-		}
-		// current token is the bracket
-		if (is_bracket(term)) {
-			if (is_open_bracket(term)) {
-				op_stack.push(term);
-				continue;
-			}
-			if (is_close_bracket(term)) {
-				while (not op_stack.empty()) {
-					if (is_open_bracket(op_stack.top())) {
-						op_stack.pop();
-						break;
-					}
-					if (not is_bracket(op_stack.top())) {
-						output.push_back(op_stack.top());
-					}
-					op_stack.pop();
-				}
-				continue;
-			}
-		}
-		// we must never get to this point
-		error = true;
-		break;
+const char* opcode_name(opcode op);
+// number of stack values consumed by the opcode,
+// reduce ops consume instruction::arg values
+int opcode_arity(opcode op);
+
+class instruction {
+public:
+	opcode op{};
+	// index into program constants or variable slot,
+	// op_vars keep two 16-bit slots (a << 16 | b),
+	// reduce ops the number of values
+	unsigned arg{};
+};
+
+// number of stack values consumed by the instruction
+size_t instruction_arity(const instruction& in);
+
+// code range of an independent subtree, evaluated as one parallel task
+class fork_task {
+public:
+	size_t begin{};
+	size_t end{};
+	// nested tasks in code order, indices into program::forks
+	vector<size_t> children{};
+	// a pairwise reduction (the last instruction of the task) evaluated
+	// in pieces of terms, first instruction of every piece
+	vector<size_t> pieces{};
+	// stack needed by the biggest piece
+	size_t piece_stack{};
+};
+
+class program {
+private:
+	// executes code[begin, end) on the stack below top
+	void run_span(size_t begin, size_t end, const double* values,
+		const double* k, double*& top) const;
+	bool run_integer_span(size_t begin, size_t end, const long long* values,
+		const long long* k, long long*& top) const;
+	// evaluates forks[index], child tasks run on the pool
+	template <class T, class Span, class Reduce>
+	bool run_fork(thread_pool& pool, size_t index, const Span& span,
+		const Reduce& reduce, T& result) const;
+	// pieces of a reduction task run on the pool
+	template <class T, class Span, class Reduce>
+	bool run_reduction(thread_pool& pool, const fork_task& task, const Span& span,
+		const Reduce& reduce, T& result) const;
+public:
+	vector<instruction> code{};
+	vector<double> constants{};
+	// variable names, dense slots in order of first use
+	vector<string> slots{};
+	size_t stack_size{};
+	// integer literals only and no division
+	bool integer{};
+	// constants of integer programs
+	vector<long long> int_constants{};
+	// subtree tasks of huge programs, forks[0] is the whole code,
+	// empty when the program runs serially
+	vector<fork_task> forks{};
+
+	// slot of the variable, -1 if the program does not use it
+	int slot_of(const string& name) const;
+	// values[] holds one value per slot, literals (when given) replace
+	// the constants with those of another expression of the same shape
+	double run(const double* values = nullptr,
+		const literal_values* literals = nullptr) const;
+	// exact 64-bit evaluation, returns false on overflow or when
+	// a variable value is not an integer
+	bool run_integer(long long& result, const double* values = nullptr,
+		const literal_values* literals = nullptr) const;
+	// same results as run() / run_integer(), forks evaluated in parallel
+	double run_parallel(thread_pool& pool, const double* values = nullptr,
+		const literal_values* literals = nullptr) const;
+	bool run_integer_parallel(thread_pool& pool, long long& result,
+		const double* values = nullptr, const literal_values* literals = nullptr) const;
+};
+
+class compile_options {
+public:
+	// fuse frequent opcode sequences into superinstructions
+	bool fuse{ true };
+	// evaluate integer programs in checked 64-bit arithmetic
+	bool integer{ true };
+	// subtrees of at least this many instructions become parallel
+	// tasks when a node has two of them, 0 never forks
+	size_t fork_threshold{ 1 << 15 };
+	// chains of at least this many terms of one + or * are evaluated
+	// as a pairwise reduction: more accurate, in parallel when long, but
+	// rounded differently than left to right, 0 keeps the order
+	size_t pairwise_terms{};
+	// operands of + and * in canonical order, exact
+	bool canonical{};
+	// also sort the terms of chains of + and *, may change rounding
+	bool canonical_chains{};
+	// compute subtrees without variables once, at compile time (exact);
+	// for programs run many times with variables, never for programs
+	// shared by shape, which take their literals from each line (see
+	// shape_options())
+	bool fold_constants{};
+};
+
+// options for programs shared by shape: folding would drop the literals
+compile_options shape_options(compile_options opt) {
+	opt.fold_constants = false;
+	return opt;
+}
+
+class compiler {
+private:
+	token_list tokens;
+	compile_options options;
+	program prog;
+	bool error;
+	// fold() left its constants, int_constants are set when exact
+	bool folded;
+	void emit(opcode op, unsigned arg = 0);
+	void fuse();
+	// marks programs that can run in 64-bit integers
+	void detect_integer();
+	// computes required stack size, sets error on stack underflow
+	void verify_stack();
+	// finds independent subtrees worth a task of their own
+	void plan_forks();
+	// turns long chains of + or * into reduce ops
+	void reassociate();
+	// replaces subtrees without variables by their value
+	void fold();
+public:
+	compiler(const token_list& postfix, const compile_options& opt = {});
+	void compile();
+	bool error_state();
+	program get_program() const;
+};
+
+// opcode pair frequencies over a corpus of programs
+class opcode_stats {
+private:
+	map<pair<opcode, opcode>, size_t> pairs;
+	size_t programs;
+public:
+	opcode_stats();
+	void add(const program& p);
+	void print(ostream& out) const;
+};
+
+const char* opcode_name(opcode op) {
+	switch (op) {
+		case opcode::push: return "push";
+		case opcode::load: return "load";
+		case opcode::add: return "add";
+		case opcode::sub: return "sub";
+		case opcode::mul: return "mul";
+		case opcode::div: return "div";
+		case opcode::add_const: return "add_const";
+		case opcode::sub_const: return "sub_const";
+		case opcode::mul_const: return "mul_const";
+		case opcode::div_const: return "div_const";
+		case opcode::add_add: return "add_add";
+		case opcode::mul_mul: return "mul_mul";
+		case opcode::mul_add: return "mul_add";
+		case opcode::mul_sub: return "mul_sub";
+		case opcode::add_var: return "add_var";
+		case opcode::sub_var: return "sub_var";
+		case opcode::mul_var: return "mul_var";
+		case opcode::div_var: return "div_var";
+		case opcode::add_vars: return "add_vars";
+		case opcode::sub_vars: return "sub_vars";
+		case opcode::mul_vars: return "mul_vars";
+		case opcode::div_vars: return "div_vars";
+		case opcode::reduce_add: return "reduce_add";
+		case opcode::reduce_mul: return "reduce_mul";
 	}
-	// finalization
-	while (not op_stack.empty()) {
-		output.push_back(op_stack.top());
-		op_stack.pop();
+	return "?";
+}
+
+int opcode_arity(opcode op) {
+	switch (op) {
+		case opcode::push:
+		case opcode::load:
+		case opcode::add_vars:
+		case opcode::sub_vars:
+		case opcode::mul_vars:
+		case opcode::div_vars:
+			return 0;
+		case opcode::add_const:
+		case opcode::sub_const:
+		case opcode::mul_const:
+		case opcode::div_const:
+		case opcode::add_var:
+		case opcode::sub_var:
+		case opcode::mul_var:
+		case opcode::div_var:
+			return 1;
+		case opcode::add:
+		case opcode::sub:
+		case opcode::mul:
+		case opcode::div:
+		case opcode::reduce_add:
+		case opcode::reduce_mul:
+			return 2;
+		case opcode::add_add:
+		case opcode::mul_mul:
+		case opcode::mul_add:
+		case opcode::mul_sub:
+			return 3;
 	}
-	tokens.assign(output.begin(), output.end());
-	if (check_infix_for_brackets(tokens)) error = true;
+	return 0;
 }
 
-bool eval::check_infix_for_brackets(const token_list& tl) {
-	for (token term : tl)
-		if (is_bracket(term)) return true;
-	return false;
+size_t instruction_arity(const instruction& in) {
+	if (in.op == opcode::reduce_add || in.op == opcode::reduce_mul) return in.arg;
+	return opcode_arity(in.op);
 }
 
-void eval::solve() {
-	this->to_postfix();
-	if (error) return;
-	stack<token, token_list> nums{};
-	for (token term : tokens) {
-		if (is_number(term)) {
-			nums.push(term);
-			continue;
-		}
-		if (is_operator(term)) {
-			double x{}, y{};
-			token tr;
-			tr.type = token_type::number;
-			y = nums.top().number; nums.pop();
-			x = nums.top().number; nums.pop();
-			switch (term.type) {
-				case token_type::op_add:
-					tr.number = x + y;
-					nums.push(tr);
-					break;
-				case token_type::op_sub:
-					tr.number = x - y;
-					nums.push(tr);
-					break;
-				case token_type::op_mul:
-					tr.number = x * y;
-					nums.push(tr);
-					break;
-				case token_type::op_div:
-					tr.number = x / y;
-					nums.push(tr);
-					break;
-			}
-			continue;
-		}
-		// bad token list
-		error = true;
-		break;
+/*  ~ Pairwise reduction ~
+
+	Chains of one associative operator are reduced in the order of
+	numpy's pairwise summation: blocks of more than 128 values are split
+	in two halves (the first a multiple of 8) reduced separately, smaller
+	blocks run eight interleaved accumulators that vectorize, then fold
+	them as a tree and add the tail. The rounding error grows with
+	log n instead of n. The order depends only on the number of values,
+	so the parallel evaluation of reduce_piece_terms pieces gives the
+	same result as the serial one with any number of threads. */
+
+// pieces of parallel reductions, at least 128
+const size_t reduce_piece_terms = 4096;
+
+// size of the first half of a pairwise block of n > 128 values
+size_t pairwise_split(size_t n) {
+	size_t h = n / 2;
+	return h - h % 8;
+}
+
+// x[lo] = x[lo] op ... op x[lo + n - 1] in pairwise order by calls of
+// combine(dst, src) that do x[dst] = x[dst] op x[src], stops when
+// combine returns false
+template <class Combine>
+bool pairwise_order(size_t lo, size_t n, const Combine& combine) {
+	if (n > 128) {
+		size_t h = pairwise_split(n);
+		return pairwise_order(lo, h, combine) &&
+			pairwise_order(lo + h, n - h, combine) && combine(lo, lo + h);
 	}
-	this->result = nums.top().number;
+	size_t i = 1;
+	if (n >= 8) {
+		for (i = 8; i + 8 <= n; i += 8)
+			for (size_t j = 0; j < 8; ++j)
+				if (not combine(lo + j, lo + i + j)) return false;
+		for (size_t s = 1; s < 8; s *= 2)
+			for (size_t j = 0; j < 8; j += 2 * s)
+				if (not combine(lo + j, lo + j + s)) return false;
+	}
+	for (; i < n; ++i)
+		if (not combine(lo, lo + i)) return false;
+	return true;
 }
 
+// pairwise_order() of doubles, written out so that it vectorizes
+template <class Op>
+double pairwise_reduce(const double* x, size_t n, Op op) {
+	if (n > 128) {
+		size_t h = pairwise_split(n);
+		double a = pairwise_reduce(x, h, op);
+		return op(a, pairwise_reduce(x + h, n - h, op));
+	}
+	if (n < 8) {
+		double r = x[0];
+		for (size_t i = 1; i < n; ++i) r = op(r, x[i]);
+		return r;
+	}
+	double r[8];
+	for (size_t j = 0; j < 8; ++j) r[j] = x[j];
+	size_t i = 8;
+	for (; i + 8 <= n; i += 8)
+		for (size_t j = 0; j < 8; ++j) r[j] = op(r[j], x[i + j]);
+	double s = op(op(op(r[0], r[1]), op(r[2], r[3])), op(op(r[4], r[5]), op(r[6], r[7])));
+	for (; i < n; ++i) s = op(s, x[i]);
+	return s;
+}
 
-void string_strip(string& str) {
-	while (str.size() > 0 && isspace(str[0])) str.erase(str.begin());
-	while (str.size() > 0 && isspace(str[str.size() - 1])) str.erase(str.end() - 1);
+double reduce_pairwise(opcode op, const double* x, size_t n) {
+	if (op == opcode::reduce_mul)
+		return pairwise_reduce(x, n, [](double a, double b) { return a * b; });
+	return pairwise_reduce(x, n, [](double a, double b) { return a + b; });
 }
 
-int main() {
-	cout << "Simple math expression evaulator v " << VERSION << "\n"
-		<<  "Unary + and - is not supported. Operations: + - * / \n"
-		<<  "Use (.) for decimal point, blank line to exit \n\n";
-	string line;
-	do {
-		cout << "(expr): ";
+// first term of every piece of a pairwise reduction of n terms,
+// pieces are the blocks of pairwise_order() with at most limit terms
+void pairwise_pieces(size_t lo, size_t n, size_t limit, vector<size_t>& starts) {
+	if (n <= limit) {
+		starts.push_back(lo);
+		return;
+	}
+	size_t h = pairwise_split(n);
+	pairwise_pieces(lo, h, limit, starts);
+	pairwise_pieces(lo + h, n - h, limit, starts);
+}
+
+// combines the results of pairwise_pieces() like pairwise_order() does
+template <class T, class Combine>
+bool combine_pieces(size_t n, size_t limit, const T* partial, size_t& next,
+	T& result, const Combine& combine) {
+	if (n <= limit) {
+		result = partial[next++];
+		return true;
+	}
+	size_t h = pairwise_split(n);
+	T right{};
+	return combine_pieces(h, limit, partial, next, result, combine) &&
+		combine_pieces(n - h, limit, partial, next, right, combine) &&
+		combine(result, right);
+}
+
+int program::slot_of(const string& name) const {
+	for (size_t i = 0; i < slots.size(); ++i)
+		if (slots[i] == name) return (int)i;
+	return -1;
+}
+
+double program::run(const double* values, const literal_values* literals) const {
+	// small programs run on a local stack, no allocation
+	double local[64];
+	vector<double> heap;
+	double* sp = local;
+	if (stack_size > 64) {
+		heap.resize(stack_size);
+		sp = heap.data();
+	}
+	// sp points to the top of the stack
+	--sp;
+	const double* k = literals ? literals->constants.data() : constants.data();
+	run_span(0, code.size(), values, k, sp);
+	return sp[0];
+}
+
+void program::run_span(size_t begin, size_t end, const double* values,
+	const double* k, double*& top) const {
+	double* sp = top;
+	const double* v = values;
+	for (size_t pc = begin; pc < end; ++pc) {
+		const instruction& in = code[pc];
+		switch (in.op) {
+			case opcode::push:
+				*++sp = k[in.arg];
+				break;
+			case opcode::load:
+				*++sp = v[in.arg];
+				break;
+			case opcode::add:
+				sp[-1] = sp[-1] + sp[0];
+				--sp;
+				break;
+			case opcode::sub:
+				sp[-1] = sp[-1] - sp[0];
+				--sp;
+				break;
+			case opcode::mul:
+				sp[-1] = sp[-1] * sp[0];
+				--sp;
+				break;
+			case opcode::div:
+				sp[-1] = sp[-1] / sp[0];
+				--sp;
+				break;
+			case opcode::add_const:
+				sp[0] = sp[0] + k[in.arg];
+				break;
+			case opcode::sub_const:
+				sp[0] = sp[0] - k[in.arg];
+				break;
+			case opcode::mul_const:
+				sp[0] = sp[0] * k[in.arg];
+				break;
+			case opcode::div_const:
+				sp[0] = sp[0] / k[in.arg];
+				break;
+			case opcode::add_add:
+				sp[-2] = sp[-2] + (sp[-1] + sp[0]);
+				sp -= 2;
+				break;
+			case opcode::mul_mul:
+				sp[-2] = sp[-2] * (sp[-1] * sp[0]);
+				sp -= 2;
+				break;
+			case opcode::mul_add:
+				sp[-2] = sp[-2] + sp[-1] * sp[0];
+				sp -= 2;
+				break;
+			case opcode::mul_sub:
+				sp[-2] = sp[-2] - sp[-1] * sp[0];
+				sp -= 2;
+				break;
+			case opcode::add_var:
+				sp[0] = sp[0] + v[in.arg];
+				break;
+			case opcode::sub_var:
+				sp[0] = sp[0] - v[in.arg];
+				break;
+			case opcode::mul_var:
+				sp[0] = sp[0] * v[in.arg];
+				break;
+			case opcode::div_var:
+				sp[0] = sp[0] / v[in.arg];
+				break;
+			case opcode::add_vars:
+				*++sp = v[in.arg >> 16] + v[in.arg & 0xffff];
+				break;
+			case opcode::sub_vars:
+				*++sp = v[in.arg >> 16] - v[in.arg & 0xffff];
+				break;
+			case opcode::mul_vars:
+				*++sp = v[in.arg >> 16] * v[in.arg & 0xffff];
+				break;
+			case opcode::div_vars:
+				*++sp = v[in.arg >> 16] / v[in.arg & 0xffff];
+				break;
+			case opcode::reduce_add:
+			case opcode::reduce_mul:
+				sp -= in.arg - 1;
+				sp[0] = reduce_pairwise(in.op, sp, in.arg);
+				break;
+		}
+	}
+	top = sp;
+}
+
+// checked 64-bit arithmetic, false on overflow
+bool checked_add(long long x, long long y, long long& r) {
+#if defined(__GNUC__) || defined(__clang__)
+	return not __builtin_add_overflow(x, y, &r);
+#else
+	if ((y > 0 && x > LLONG_MAX - y) || (y < 0 && x < LLONG_MIN - y)) return false;
+	r = x + y;
+	return true;
+#endif
+}
+
+bool checked_sub(long long x, long long y, long long& r) {
+#if defined(__GNUC__) || defined(__clang__)
+	return not __builtin_sub_overflow(x, y, &r);
+#else
+	if ((y < 0 && x > LLONG_MAX + y) || (y > 0 && x < LLONG_MIN + y)) return false;
+	r = x - y;
+	return true;
+#endif
+}
+
+bool checked_mul(long long x, long long y, long long& r) {
+#if defined(__GNUC__) || defined(__clang__)
+	return not __builtin_mul_overflow(x, y, &r);
+#else
+	if (x != 0 && y != 0) {
+		if (x == -1 && y == LLONG_MIN) return false;
+		if (y == -1 && x == LLONG_MIN) return false;
+		long long p = x * y;
+		if (p / y != x) return false;
+	}
+	r = x * y;
+	return true;
+#endif
+}
+
+// variables of integer programs must hold integers exact in double
+bool integer_value(double x, long long& r) {
+	const double limit = 9007199254740992.0;
+	if (not (x >= -limit && x <= limit) || x != (double)(long long)x)
+		return false;
+	r = (long long)x;
+	return true;
+}
+
+// checked pairwise reduction, result in x[0], false on overflow
+bool reduce_pairwise(opcode op, long long* x, size_t n) {
+	if (op == opcode::reduce_mul)
+		return pairwise_order(0, n, [x](size_t d, size_t s) {
+			return checked_mul(x[d], x[s], x[d]);
+		});
+	return pairwise_order(0, n, [x](size_t d, size_t s) {
+		return checked_add(x[d], x[s], x[d]);
+	});
+}
+
+bool program::run_integer(long long& result, const double* values,
+	const literal_values* literals) const {
+	long long local_vars[64];
+	vector<long long> heap_vars;
+	long long* v = local_vars;
+	if (slots.size() > 64) {
+		heap_vars.resize(slots.size());
+		v = heap_vars.data();
+	}
+	for (size_t i = 0; i < slots.size(); ++i)
+		if (not integer_value(values[i], v[i])) return false;
+	long long local[64];
+	vector<long long> heap;
+	long long* sp = local;
+	if (stack_size > 64) {
+		heap.resize(stack_size);
+		sp = heap.data();
+	}
+	--sp;
+	const long long* k = literals ? literals->int_constants.data() : int_constants.data();
+	if (not run_integer_span(0, code.size(), v, k, sp)) return false;
+	result = sp[0];
+	return true;
+}
+
+bool program::run_integer_span(size_t begin, size_t end, const long long* values,
+	const long long* k, long long*& top) const {
+	long long* sp = top;
+	const long long* v = values;
+	bool ok = true;
+	long long t{};
+	for (size_t pc = begin; pc < end; ++pc) {
+		const instruction& in = code[pc];
+		switch (in.op) {
+			case opcode::push:
+				*++sp = k[in.arg];
+				break;
+			case opcode::load:
+				*++sp = v[in.arg];
+				break;
+			case opcode::add:
+				ok = checked_add(sp[-1], sp[0], sp[-1]);
+				--sp;
+				break;
+			case opcode::sub:
+				ok = checked_sub(sp[-1], sp[0], sp[-1]);
+				--sp;
+				break;
+			case opcode::mul:
+				ok = checked_mul(sp[-1], sp[0], sp[-1]);
+				--sp;
+				break;
+			case opcode::add_const:
+				ok = checked_add(sp[0], k[in.arg], sp[0]);
+				break;
+			case opcode::sub_const:
+				ok = checked_sub(sp[0], k[in.arg], sp[0]);
+				break;
+			case opcode::mul_const:
+				ok = checked_mul(sp[0], k[in.arg], sp[0]);
+				break;
+			case opcode::add_add:
+				ok = checked_add(sp[-1], sp[0], t) && checked_add(sp[-2], t, sp[-2]);
+				sp -= 2;
+				break;
+			case opcode::mul_mul:
+				ok = checked_mul(sp[-1], sp[0], t) && checked_mul(sp[-2], t, sp[-2]);
+				sp -= 2;
+				break;
+			case opcode::mul_add:
+				ok = checked_mul(sp[-1], sp[0], t) && checked_add(sp[-2], t, sp[-2]);
+				sp -= 2;
+				break;
+			case opcode::mul_sub:
+				ok = checked_mul(sp[-1], sp[0], t) && checked_sub(sp[-2], t, sp[-2]);
+				sp -= 2;
+				break;
+			case opcode::add_var:
+				ok = checked_add(sp[0], v[in.arg], sp[0]);
+				break;
+			case opcode::sub_var:
+				ok = checked_sub(sp[0], v[in.arg], sp[0]);
+				break;
+			case opcode::mul_var:
+				ok = checked_mul(sp[0], v[in.arg], sp[0]);
+				break;
+			case opcode::add_vars:
+				ok = checked_add(v[in.arg >> 16], v[in.arg & 0xffff], *++sp);
+				break;
+			case opcode::sub_vars:
+				ok = checked_sub(v[in.arg >> 16], v[in.arg & 0xffff], *++sp);
+				break;
+			case opcode::mul_vars:
+				ok = checked_mul(v[in.arg >> 16], v[in.arg & 0xffff], *++sp);
+				break;
+			case opcode::reduce_add:
+			case opcode::reduce_mul:
+				sp -= in.arg - 1;
+				ok = reduce_pairwise(in.op, sp, in.arg);
+				break;
+			default:
+				// division is never integer
+				ok = false;
+				break;
+		}
+		if (not ok) return false;
+	}
+	top = sp;
+	return true;
+}
+
+/*  ~ Fork-join evaluation ~
+
+	A node whose operands are two or more big subtrees (the top of a
+	generated aggregate formula, a product of two long sums) does not
+	need them in sequence: compiler::plan_forks() records the code range
+	of every such operand as a fork_task. A task first evaluates its
+	child tasks, all but the first on the pool, then runs its own code
+	serially and pushes the result of a child where its range starts.
+	Every node still performs the same operation on the same operands,
+	so results are identical to run(). A long pairwise reduction is a
+	task of its own, its pieces of terms run in parallel and the piece
+	results are combined in the order of the serial reduction. */
+
+template <class T, class Span, class Reduce>
+bool program::run_fork(thread_pool& pool, size_t index, const Span& span,
+	const Reduce& reduce, T& result) const {
+	const fork_task& task = forks[index];
+	if (not task.pieces.empty()) return run_reduction(pool, task, span, reduce, result);
+	vector<T> results(task.children.size());
+	atomic<bool> ok{ true };
+	{
+		task_group group(pool);
+		for (size_t c = 1; c < task.children.size(); ++c)
+			group.run([this, &pool, &task, &span, &reduce, &results, &ok, c] {
+				if (not run_fork(pool, task.children[c], span, reduce, results[c]))
+					ok = false;
+			});
+		if (not task.children.empty() &&
+			not run_fork(pool, task.children[0], span, reduce, results[0])) ok = false;
+		group.wait();
+	}
+	if (not ok) return false;
+	vector<T> stack(stack_size);
+	T* sp = stack.data() - 1;
+	size_t pc = task.begin;
+	for (size_t c = 0; c < task.children.size(); ++c) {
+		const fork_task& child = forks[task.children[c]];
+		if (not span(pc, child.begin, sp)) return false;
+		*++sp = results[c];
+		pc = child.end;
+	}
+	if (not span(pc, task.end, sp)) return false;
+	result = sp[0];
+	return true;
+}
+
+template <class T, class Span, class Reduce>
+bool program::run_reduction(thread_pool& pool, const fork_task& task,
+	const Span& span, const Reduce& reduce, T& result) const {
+	const instruction& in = code[task.end - 1];
+	const size_t count = task.pieces.size();
+	vector<T> partial(count);
+	atomic<bool> ok{ true };
+	auto piece = [this, &task, &span, &reduce, &partial, &ok, &in, count](size_t p) {
+		vector<T> stack(task.piece_stack);
+		T* sp = stack.data() - 1;
+		size_t end = p + 1 < count ? task.pieces[p + 1] : task.end - 1;
+		if (not span(task.pieces[p], end, sp) ||
+			not reduce(in.op, stack.data(), (size_t)(sp + 1 - stack.data()), partial[p]))
+			ok = false;
+	};
+	{
+		task_group group(pool);
+		for (size_t p = 1; p < count; ++p) group.run([&piece, p] { piece(p); });
+		piece(0);
+		group.wait();
+	}
+	if (not ok) return false;
+	size_t next = 0;
+	return combine_pieces(in.arg, reduce_piece_terms, partial.data(), next, result,
+		[&reduce, &in](T& x, const T& y) {
+			T pair[2] = { x, y };
+			return reduce(in.op, pair, 2, x);
+		});
+}
+
+double program::run_parallel(thread_pool& pool, const double* values,
+	const literal_values* literals) const {
+	if (forks.empty()) return run(values, literals);
+	const double* k = literals ? literals->constants.data() : constants.data();
+	double result{};
+	run_fork(pool, 0, [this, values, k](size_t begin, size_t end, double*& sp) {
+		run_span(begin, end, values, k, sp);
+		return true;
+	}, [](opcode op, double* x, size_t n, double& r) {
+		r = reduce_pairwise(op, x, n);
+		return true;
+	}, result);
+	return result;
+}
+
+bool program::run_integer_parallel(thread_pool& pool, long long& result,
+	const double* values, const literal_values* literals) const {
+	if (forks.empty()) return run_integer(result, values, literals);
+	const long long* k = literals ? literals->int_constants.data() : int_constants.data();
+	vector<long long> v(slots.size());
+	for (size_t i = 0; i < slots.size(); ++i)
+		if (not integer_value(values[i], v[i])) return false;
+	const long long* vars = v.data();
+	return run_fork(pool, 0, [this, vars, k](size_t begin, size_t end, long long*& sp) {
+		return run_integer_span(begin, end, vars, k, sp);
+	}, [](opcode op, long long* x, size_t n, long long& r) {
+		if (not reduce_pairwise(op, x, n)) return false;
+		r = x[0];
+		return true;
+	}, result);
+}
+
+compiler::compiler(const token_list& postfix, const compile_options& opt)
+	: tokens{ postfix }, options{ opt }, prog{}, error{}, folded{} {}
+
+bool compiler::error_state() { return error; }
+program compiler::get_program() const { return prog; }
+
+void compiler::emit(opcode op, unsigned arg) {
+	instruction in;
+	in.op = op;
+	in.arg = arg;
+	prog.code.push_back(in);
+}
+
+void compiler::compile() {
+	prog = {};
+	folded = false;
+	for (const token& term : tokens) {
+		switch (term.type) {
+			case token_type::number:
+				emit(opcode::push, (unsigned)prog.constants.size());
+				prog.constants.push_back(term.number);
+				break;
+			case token_type::identifier: {
+				// bind the name to a dense slot
+				int slot = prog.slot_of(term.text);
+				if (slot < 0) {
+					slot = (int)prog.slots.size();
+					prog.slots.push_back(term.text);
+				}
+				emit(opcode::load, (unsigned)slot);
+				break;
+			}
+			case token_type::op_add:
+				emit(opcode::add);
+				break;
+			case token_type::op_sub:
+				emit(opcode::sub);
+				break;
+			case token_type::op_mul:
+				emit(opcode::mul);
+				break;
+			case token_type::op_div:
+				emit(opcode::div);
+				break;
+			default:
+				// bad token list
+				error = true;
+				return;
+		}
+	}
+	verify_stack();
+	if (error) return;
+	if (options.fold_constants) {
+		fold();
+		verify_stack();
+	}
+	if (options.pairwise_terms > 1) {
+		reassociate();
+		verify_stack();
+	}
+	if (options.fuse) {
+		fuse();
+		verify_stack();
+	}
+	if (options.integer) detect_integer();
+	plan_forks();
+}
+
+void compiler::detect_integer() {
+	prog.integer = false;
+	for (const instruction& in : prog.code) {
+		if (in.op == opcode::div || in.op == opcode::div_const || in.op == opcode::div_var ||
+			in.op == opcode::div_vars) {
+			prog.int_constants.clear();
+			return;
+		}
+	}
+	if (folded) {
+		prog.integer = prog.int_constants.size() == prog.constants.size();
+		if (not prog.integer) prog.int_constants.clear();
+		return;
+	}
+	prog.int_constants.clear();
+	for (const token& term : tokens) {
+		if (term.type != token_type::number) continue;
+		long long value{};
+		if (not integer_literal(term.text, value)) {
+			prog.int_constants.clear();
+			return;
+		}
+		prog.int_constants.push_back(value);
+	}
+	prog.integer = true;
+}
+
+void compiler::verify_stack() {
+	size_t depth = 0;
+	prog.stack_size = 0;
+	for (const instruction& in : prog.code) {
+		size_t n = instruction_arity(in);
+		if (depth < n) {
+			error = true;
+			return;
+		}
+		depth = depth - n + 1;
+		if (depth > prog.stack_size) prog.stack_size = depth;
+	}
+	if (depth != 1) error = true;
+}
+
+// first[i] is the first instruction of the subtree that ends at code[i]
+vector<size_t> subtree_starts(const vector<instruction>& code) {
+	vector<size_t> first(code.size());
+	vector<size_t> open;
+	for (size_t i = 0; i < code.size(); ++i) {
+		size_t arity = instruction_arity(code[i]);
+		size_t start = i;
+		if (arity > 0) {
+			start = open[open.size() - arity];
+			open.resize(open.size() - arity);
+		}
+		first[i] = start;
+		open.push_back(start);
+	}
+	return first;
+}
+
+/*  ~ Reassociation ~
+
+	x1 + x2 + ... + xn compiles to a left deep chain: every add waits
+	for the previous one. With compile_options::pairwise_terms the
+	compiler finds the chains of add (or mul) that run down the left
+	operands, drops the inner operators and lets one reduce_add (or
+	reduce_mul) combine all the terms pairwise. The terms stay in code
+	order, so they are still evaluated left to right. */
+
+void compiler::reassociate() {
+	vector<instruction>& code = prog.code;
+	const size_t n = code.size();
+	const size_t min = options.pairwise_terms;
+	if (n < 2 * min - 1) return;
+	vector<size_t> first = subtree_starts(code);
+	// terms of the chain that ends at code[i]
+	vector<size_t> terms(n);
+	vector<bool> inner(n);
+	for (size_t i = 0; i < n; ++i) {
+		opcode op = code[i].op;
+		if (op != opcode::add && op != opcode::mul) continue;
+		// the left operand ends right before the right one starts
+		size_t left = first[i - 1] - 1;
+		terms[i] = 2;
+		if (code[left].op == op) {
+			terms[i] = terms[left] + 1;
+			inner[left] = true;
+		}
+	}
+	vector<bool> drop(n);
+	bool any = false;
+	for (size_t i = 0; i < n; ++i) {
+		if (inner[i] || terms[i] < min) continue;
+		any = true;
+		for (size_t left = first[i - 1] - 1; code[left].op == code[i].op && inner[left];
+			left = first[left - 1] - 1) drop[left] = true;
+		code[i].arg = (unsigned)terms[i];
+		code[i].op = code[i].op == opcode::add ? opcode::reduce_add : opcode::reduce_mul;
+	}
+	if (not any) return;
+	size_t out = 0;
+	for (size_t i = 0; i < n; ++i)
+		if (not drop[i]) code[out++] = code[i];
+	code.resize(out);
+}
+
+/*  ~ Constant folding ~
+
+	With compile_options::fold_constants a subtree without variables
+	becomes one push of its value, computed with the operation the
+	interpreter would use in the same order, so results do not change.
+	Programs that may run in 64-bit integers fold exactly in both
+	arithmetics and keep a subtree that overflows. With pairwise chains
+	the left operands of a chain are kept, folding them would change
+	the terms of the reduction. */
+
+void compiler::fold() {
+	const vector<instruction>& code = prog.code;
+	// integer program candidates need the integer value of every constant
+	bool exact = options.integer;
+	vector<long long> ints;
+	for (const instruction& in : code)
+		if (in.op == opcode::div) exact = false;
+	for (const token& term : tokens) {
+		long long value{};
+		if (term.type != token_type::number) continue;
+		if (not exact || not integer_literal(term.text, value)) {
+			exact = false;
+			break;
+		}
+		ints.push_back(value);
+	}
+	vector<bool> keep(code.size());
+	if (options.pairwise_terms > 1) {
+		vector<size_t> first = subtree_starts(code);
+		for (size_t i = 1; i < code.size(); ++i) {
+			size_t right = first[i - 1];
+			if (instruction_arity(code[i]) == 2 && right > 0 && code[right - 1].op == code[i].op)
+				keep[right - 1] = true;
+		}
+	}
+
+	// first instruction of every operand on the stack, constants are
+	// always the last pushed constant
+	vector<pair<size_t, bool>> operands;
+	vector<instruction> out;
+	vector<double> k;
+	vector<long long> ik;
+	bool changed = false;
+	for (size_t i = 0; i < code.size(); ++i) {
+		instruction in = code[i];
+		if (in.op == opcode::push) {
+			in.arg = (unsigned)k.size();
+			k.push_back(prog.constants[code[i].arg]);
+			if (exact) ik.push_back(ints[code[i].arg]);
+			operands.emplace_back(out.size(), true);
+			out.push_back(in);
+			continue;
+		}
+		if (in.op == opcode::load) {
+			operands.emplace_back(out.size(), false);
+			out.push_back(in);
+			continue;
+		}
+		pair<size_t, bool> b = operands.back();
+		operands.pop_back();
+		pair<size_t, bool> a = operands.back();
+		operands.pop_back();
+		bool constant = a.second && b.second && not keep[i];
+		double x = k.size() >= 2 ? k[k.size() - 2] : 0, y = k.empty() ? 0 : k.back();
+		double value{};
+		long long exact_value{};
+		switch (in.op) {
+			case opcode::add:
+				value = x + y;
+				if (exact && constant)
+					constant = checked_add(ik[ik.size() - 2], ik.back(), exact_value);
+				break;
+			case opcode::sub:
+				value = x - y;
+				if (exact && constant)
+					constant = checked_sub(ik[ik.size() - 2], ik.back(), exact_value);
+				break;
+			case opcode::mul:
+				value = x * y;
+				if (exact && constant)
+					constant = checked_mul(ik[ik.size() - 2], ik.back(), exact_value);
+				break;
+			default:
+				value = x / y;
+				break;
+		}
+		operands.emplace_back(a.first, constant);
+		if (not constant) {
+			out.push_back(in);
+			continue;
+		}
+		k.resize(k.size() - 1);
+		k.back() = value;
+		if (exact) {
+			ik.resize(ik.size() - 1);
+			ik.back() = exact_value;
+		}
+		out.resize(a.first + 1);
+		out.back().op = opcode::push;
+		out.back().arg = (unsigned)(k.size() - 1);
+		changed = true;
+	}
+	if (not changed) return;
+	prog.code = move(out);
+	prog.constants = move(k);
+	prog.int_constants = move(ik);
+	folded = true;
+}
+
+void compiler::plan_forks() {
+	prog.forks.clear();
+	const vector<instruction>& code = prog.code;
+	const size_t n = code.size();
+	const size_t min = options.fork_threshold;
+	if (min == 0 || n < min) return;
+	vector<size_t> first = subtree_starts(code);
+	// begin, end, reduction
+	vector<tuple<size_t, size_t, bool>> ranges{ make_tuple(0, n, false) };
+	for (size_t i = 0; i < n; ++i) {
+		const instruction& in = code[i];
+		if (in.op == opcode::reduce_add || in.op == opcode::reduce_mul) {
+			if (in.arg > reduce_piece_terms && i + 1 - first[i] >= min)
+				ranges.push_back(make_tuple(first[i], i + 1, true));
+			continue;
+		}
+		size_t arity = instruction_arity(in);
+		if (arity < 2) continue;
+		// operands of a node end right before it, the previous one right
+		// before the first instruction of the next
+		pair<size_t, size_t> operand[3];
+		size_t big = 0;
+		size_t end = i;
+		for (size_t a = 0; a < arity; ++a) {
+			operand[a] = { first[end - 1], end };
+			if (end - first[end - 1] >= min) ++big;
+			end = first[end - 1];
+		}
+		if (big < 2) continue;
+		for (size_t a = 0; a < arity; ++a)
+			if (operand[a].second - operand[a].first >= min)
+				ranges.push_back(make_tuple(operand[a].first, operand[a].second, false));
+	}
+	// nest the ranges, outer ones and reductions first
+	sort(ranges.begin(), ranges.end(), [](const tuple<size_t, size_t, bool>& x,
+		const tuple<size_t, size_t, bool>& y) {
+		if (get<0>(x) != get<0>(y)) return get<0>(x) < get<0>(y);
+		if (get<1>(x) != get<1>(y)) return get<1>(x) > get<1>(y);
+		return get<2>(x) && not get<2>(y);
+	});
+	vector<size_t> outer;
+	for (size_t r = 0; r < ranges.size(); ++r) {
+		size_t begin = get<0>(ranges[r]);
+		size_t end = get<1>(ranges[r]);
+		if (r > 0 && begin == get<0>(ranges[r - 1]) && end == get<1>(ranges[r - 1]))
+			continue;
+		while (not outer.empty() && prog.forks[outer.back()].end <= begin)
+			outer.pop_back();
+		// the terms of a reduction run serially inside its pieces
+		if (not outer.empty() && not prog.forks[outer.back()].pieces.empty())
+			continue;
+		fork_task task;
+		task.begin = begin;
+		task.end = end;
+		if (get<2>(ranges[r])) {
+			// first instruction of every term, then of every piece
+			const size_t terms = code[end - 1].arg;
+			vector<size_t> term_start(terms);
+			size_t e = end - 1;
+			for (size_t t = terms; t-- > 0; e = first[e - 1]) term_start[t] = first[e - 1];
+			vector<size_t> starts;
+			pairwise_pieces(0, terms, reduce_piece_terms, starts);
+			for (size_t s : starts) task.pieces.push_back(term_start[s]);
+			for (size_t p = 0; p < task.pieces.size(); ++p) {
+				size_t stop = p + 1 < task.pieces.size() ? task.pieces[p + 1] : end - 1;
+				size_t depth = 0;
+				for (size_t i = task.pieces[p]; i < stop; ++i) {
+					depth = depth - instruction_arity(code[i]) + 1;
+					task.piece_stack = max(task.piece_stack, depth);
+				}
+			}
+		}
+		if (not outer.empty()) prog.forks[outer.back()].children.push_back(prog.forks.size());
+		outer.push_back(prog.forks.size());
+		prog.forks.push_back(task);
+	}
+	if (prog.forks.size() == 1 && prog.forks[0].pieces.empty()) prog.forks.clear();
+}
+
+/*  ~ Superinstructions ~
+
+	Every dispatch of the interpreter loop costs a branch, so the most
+	frequent opcode pairs are fused into single instructions. The pairs
+	follow from the postfix code of the grammar: the right operand of
+	most operators is a literal, so push;op is the commonest pair;
+	sums of products end in mul;add or mul;sub, and bracketed chains
+	repeat add;add and mul;mul. With variables load;op and load;load;op
+	take the place of push;op. `simple_eval --opstats` prints the pair
+	counts of any input, to check the choice against a workload. Fusion
+	is greedy from left to right and does not change the order of
+	floating point operations. */
+
+void compiler::fuse() {
+	vector<instruction> out{};
+	const vector<instruction>& in = prog.code;
+	for (size_t i = 0; i < in.size(); ++i) {
+		instruction cur = in[i];
+		// load a; load b; op
+		if (i + 2 < in.size() && cur.op == opcode::load &&
+			in[i + 1].op == opcode::load && cur.arg <= 0xffff &&
+			in[i + 1].arg <= 0xffff) {
+			opcode next = in[i + 2].op;
+			opcode fused = cur.op;
+			if (next == opcode::add) fused = opcode::add_vars;
+			if (next == opcode::sub) fused = opcode::sub_vars;
+			if (next == opcode::mul) fused = opcode::mul_vars;
+			if (next == opcode::div) fused = opcode::div_vars;
+			if (fused != cur.op) {
+				cur.op = fused;
+				cur.arg = (cur.arg << 16) | in[i + 1].arg;
+				out.push_back(cur);
+				i += 2;
+				continue;
+			}
+		}
+		if (i + 1 < in.size()) {
+			opcode next = in[i + 1].op;
+			opcode fused = cur.op;
+			if (cur.op == opcode::push) {
+				if (next == opcode::add) fused = opcode::add_const;
+				if (next == opcode::sub) fused = opcode::sub_const;
+				if (next == opcode::mul) fused = opcode::mul_const;
+				if (next == opcode::div) fused = opcode::div_const;
+			}
+			if (cur.op == opcode::load) {
+				if (next == opcode::add) fused = opcode::add_var;
+				if (next == opcode::sub) fused = opcode::sub_var;
+				if (next == opcode::mul) fused = opcode::mul_var;
+				if (next == opcode::div) fused = opcode::div_var;
+			}
+			if (cur.op == opcode::mul) {
+				if (next == opcode::add) fused = opcode::mul_add;
+				if (next == opcode::sub) fused = opcode::mul_sub;
+				if (next == opcode::mul) fused = opcode::mul_mul;
+			}
+			if (cur.op == opcode::add && next == opcode::add)
+				fused = opcode::add_add;
+			if (fused != cur.op) {
+				cur.op = fused;
+				++i;
+			}
+		}
+		out.push_back(cur);
+	}
+	prog.code.swap(out);
+}
+
+opcode_stats::opcode_stats() : pairs{}, programs{} {}
+
+void opcode_stats::add(const program& p) {
+	++programs;
+	for (size_t i = 0; i + 1 < p.code.size(); ++i)
+		++pairs[make_pair(p.code[i].op, p.code[i + 1].op)];
+}
+
+void opcode_stats::print(ostream& out) const {
+	vector<pair<size_t, pair<opcode, opcode>>> sorted{};
+	size_t total = 0;
+	for (const auto& p : pairs) {
+		sorted.push_back(make_pair(p.second, p.first));
+		total += p.second;
+	}
+	sort(sorted.begin(), sorted.end(),
+		[](const pair<size_t, pair<opcode, opcode>>& a,
+			const pair<size_t, pair<opcode, opcode>>& b) { return a.first > b.first; });
+	out << "programs: " << programs << ", opcode pairs: " << total << "\n";
+	for (const auto& p : sorted) {
+		out << opcode_name(p.second.first) << " " << opcode_name(p.second.second)
+			<< "\t" << p.first << "\t" << (100.0 * p.first / total) << "%\n";
+	}
+}
+
+/*  ~ Columnar evaluation ~
+
+	column_evaluator runs one program over n rows given one contiguous
+	array per variable slot. Each instruction is applied to whole columns
+	by a kernel, so the interpreter dispatch is paid once per column
+	instead of once per value. Rows are processed in tiles (1024 rows by
+	default): the whole program runs over one tile before the next, so
+	the temporaries of a tile stay in L1 cache instead of streaming full
+	columns through memory once per instruction. Kernels are picked at
+	run time: AVX-512,
+	AVX2 or plain loops. Every lane does the same IEEE operation as
+	program::run(), so results are identical to the scalar interpreter
+	(double arithmetic, the integer path is not used here). */
+
+enum class simd_level {
+	scalar,
+	avx2,
+	avx512
+};
+
+const char* simd_level_name(simd_level level);
+// best level supported by the CPU
+simd_level detect_simd_level();
+
+// operand of a column operation, a column or one value for all rows
+class column_operand {
+public:
+	const double* data{};
+	double value{};
+	bool scalar{};
+};
+
+class column_evaluator {
+private:
+	program prog;
+	simd_level level;
+	size_t tile_rows;
+	// one tile of temporaries per stack level
+	vector<double> scratch;
+	vector<column_operand> stack;
+	// out = x op y over n rows, op is add, sub, mul or div,
+	// at least one operand is a column
+	void apply(opcode op, const column_operand& x, const column_operand& y,
+		double* out, size_t n);
+	// runs the program over rows [row, row + n), n <= tile_rows
+	void run_tile(const double* const* columns, size_t row, size_t n, double* out);
+public:
+	column_evaluator(const program& p);
+	void set_simd_level(simd_level l);
+	simd_level get_simd_level() const;
+	void set_tile_rows(size_t rows);
+	size_t get_tile_rows() const;
+	// columns[slot] holds n values of the variable, out receives n results
+	void run(const double* const* columns, size_t n, double* out);
+};
+
+const char* simd_level_name(simd_level level) {
+	switch (level) {
+		case simd_level::scalar: return "scalar";
+		case simd_level::avx2: return "avx2";
+		case simd_level::avx512: return "avx512";
+	}
+	return "?";
+}
+
+#ifdef SIMPLE_EVAL_X86
+simd_level detect_simd_level() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return simd_level::avx512;
+	if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+	return simd_level::scalar;
+}
+#else
+simd_level detect_simd_level() { return simd_level::scalar; }
+#endif
+
+// column kernels: vv both columns, vs column and value, sv value and column
+
+void scalar_vv(opcode op, const double* a, const double* b, double* out, size_t n) {
+	switch (op) {
+		case opcode::add: for (size_t i = 0; i < n; ++i) out[i] = a[i] + b[i]; break;
+		case opcode::sub: for (size_t i = 0; i < n; ++i) out[i] = a[i] - b[i]; break;
+		case opcode::mul: for (size_t i = 0; i < n; ++i) out[i] = a[i] * b[i]; break;
+		case opcode::div: for (size_t i = 0; i < n; ++i) out[i] = a[i] / b[i]; break;
+		default: break;
+	}
+}
+
+void scalar_vs(opcode op, const double* a, double b, double* out, size_t n) {
+	switch (op) {
+		case opcode::add: for (size_t i = 0; i < n; ++i) out[i] = a[i] + b; break;
+		case opcode::sub: for (size_t i = 0; i < n; ++i) out[i] = a[i] - b; break;
+		case opcode::mul: for (size_t i = 0; i < n; ++i) out[i] = a[i] * b; break;
+		case opcode::div: for (size_t i = 0; i < n; ++i) out[i] = a[i] / b; break;
+		default: break;
+	}
+}
+
+void scalar_sv(opcode op, double a, const double* b, double* out, size_t n) {
+	switch (op) {
+		case opcode::add: for (size_t i = 0; i < n; ++i) out[i] = a + b[i]; break;
+		case opcode::sub: for (size_t i = 0; i < n; ++i) out[i] = a - b[i]; break;
+		case opcode::mul: for (size_t i = 0; i < n; ++i) out[i] = a * b[i]; break;
+		case opcode::div: for (size_t i = 0; i < n; ++i) out[i] = a / b[i]; break;
+		default: break;
+	}
+}
+
+#ifdef SIMPLE_EVAL_X86
+// one kernel body per vector width, tails go to the scalar kernels
+#define SIMPLE_EVAL_VECTOR_KERNELS(isa, features, vec, width, vload, vstore, vset1, vadd, vsub, vmul, vdiv) \
+__attribute__((target(features))) \
+void isa##_vv(opcode op, const double* a, const double* b, double* out, size_t n) { \
+	size_t i = 0; \
+	switch (op) { \
+		case opcode::add: for (; i + width <= n; i += width) vstore(out + i, vadd(vload(a + i), vload(b + i))); break; \
+		case opcode::sub: for (; i + width <= n; i += width) vstore(out + i, vsub(vload(a + i), vload(b + i))); break; \
+		case opcode::mul: for (; i + width <= n; i += width) vstore(out + i, vmul(vload(a + i), vload(b + i))); break; \
+		case opcode::div: for (; i + width <= n; i += width) vstore(out + i, vdiv(vload(a + i), vload(b + i))); break; \
+		default: break; \
+	} \
+	scalar_vv(op, a + i, b + i, out + i, n - i); \
+} \
+__attribute__((target(features))) \
+void isa##_vs(opcode op, const double* a, double b, double* out, size_t n) { \
+	size_t i = 0; \
+	vec vb = vset1(b); \
+	switch (op) { \
+		case opcode::add: for (; i + width <= n; i += width) vstore(out + i, vadd(vload(a + i), vb)); break; \
+		case opcode::sub: for (; i + width <= n; i += width) vstore(out + i, vsub(vload(a + i), vb)); break; \
+		case opcode::mul: for (; i + width <= n; i += width) vstore(out + i, vmul(vload(a + i), vb)); break; \
+		case opcode::div: for (; i + width <= n; i += width) vstore(out + i, vdiv(vload(a + i), vb)); break; \
+		default: break; \
+	} \
+	scalar_vs(op, a + i, b, out + i, n - i); \
+} \
+__attribute__((target(features))) \
+void isa##_sv(opcode op, double a, const double* b, double* out, size_t n) { \
+	size_t i = 0; \
+	vec va = vset1(a); \
+	switch (op) { \
+		case opcode::add: for (; i + width <= n; i += width) vstore(out + i, vadd(va, vload(b + i))); break; \
+		case opcode::sub: for (; i + width <= n; i += width) vstore(out + i, vsub(va, vload(b + i))); break; \
+		case opcode::mul: for (; i + width <= n; i += width) vstore(out + i, vmul(va, vload(b + i))); break; \
+		case opcode::div: for (; i + width <= n; i += width) vstore(out + i, vdiv(va, vload(b + i))); break; \
+		default: break; \
+	} \
+	scalar_sv(op, a, b + i, out + i, n - i); \
+}
+
+SIMPLE_EVAL_VECTOR_KERNELS(avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd,
+	_mm256_set1_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd)
+SIMPLE_EVAL_VECTOR_KERNELS(avx512, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd,
+	_mm512_set1_pd, _mm512_add_pd, _mm512_sub_pd, _mm512_mul_pd, _mm512_div_pd)
+
+#undef SIMPLE_EVAL_VECTOR_KERNELS
+#endif
+
+column_evaluator::column_evaluator(const program& p)
+	: prog{ p }, level{ detect_simd_level() }, tile_rows{ 1024 }, scratch{},
+	stack{} {}
+
+void column_evaluator::set_simd_level(simd_level l) {
+	// never above what the CPU supports
+	if (l <= detect_simd_level()) level = l;
+}
+
+simd_level column_evaluator::get_simd_level() const { return level; }
+
+void column_evaluator::set_tile_rows(size_t rows) {
+	// keep whole vectors of the widest kernel
+	tile_rows = max<size_t>(8, rows - rows % 8);
+}
+
+size_t column_evaluator::get_tile_rows() const { return tile_rows; }
+
+void column_evaluator::apply(opcode op, const column_operand& x,
+	const column_operand& y, double* out, size_t n) {
+#ifdef SIMPLE_EVAL_X86
+	if (level == simd_level::avx512) {
+		if (x.scalar) avx512_sv(op, x.value, y.data, out, n);
+		else if (y.scalar) avx512_vs(op, x.data, y.value, out, n);
+		else avx512_vv(op, x.data, y.data, out, n);
+		return;
+	}
+	if (level == simd_level::avx2) {
+		if (x.scalar) avx2_sv(op, x.value, y.data, out, n);
+		else if (y.scalar) avx2_vs(op, x.data, y.value, out, n);
+		else avx2_vv(op, x.data, y.data, out, n);
+		return;
+	}
+#endif
+	if (x.scalar) scalar_sv(op, x.value, y.data, out, n);
+	else if (y.scalar) scalar_vs(op, x.data, y.value, out, n);
+	else scalar_vv(op, x.data, y.data, out, n);
+}
+
+void column_evaluator::run(const double* const* columns, size_t n, double* out) {
+	scratch.resize(prog.stack_size * tile_rows);
+	stack.assign(prog.stack_size + 1, column_operand{});
+	for (size_t row = 0; row < n; row += tile_rows)
+		run_tile(columns, row, min(tile_rows, n - row), out + row);
+}
+
+void column_evaluator::run_tile(const double* const* columns, size_t row,
+	size_t n, double* out) {
+	// sp is the number of operands on the stack
+	size_t sp = 0;
+	const double* k = prog.constants.data();
+	auto temp = [&](size_t depth) { return scratch.data() + depth * tile_rows; };
+	auto value = [](double v) {
+		column_operand o;
+		o.value = v;
+		o.scalar = true;
+		return o;
+	};
+	auto column = [](const double* data) {
+		column_operand o;
+		o.data = data;
+		return o;
+	};
+	auto variable = [&](unsigned slot) { return column(columns[slot] + row); };
+	// x op y into the temporary of stack level `depth`
+	auto binary = [&](opcode op, const column_operand& x,
+		const column_operand& y, size_t depth) {
+		if (x.scalar && y.scalar) {
+			double r{};
+			scalar_vv(op, &x.value, &y.value, &r, 1);
+			return value(r);
+		}
+		double* t = temp(depth);
+		apply(op, x, y, t, n);
+		return column(t);
+	};
+	for (const instruction& in : prog.code) {
+		switch (in.op) {
+			case opcode::push:
+				stack[sp++] = value(k[in.arg]);
+				break;
+			case opcode::load:
+				stack[sp++] = variable(in.arg);
+				break;
+			case opcode::add:
+			case opcode::sub:
+			case opcode::mul:
+			case opcode::div:
+				stack[sp - 2] = binary(in.op, stack[sp - 2], stack[sp - 1], sp - 2);
+				--sp;
+				break;
+			case opcode::add_const:
+				stack[sp - 1] = binary(opcode::add, stack[sp - 1], value(k[in.arg]), sp - 1);
+				break;
+			case opcode::sub_const:
+				stack[sp - 1] = binary(opcode::sub, stack[sp - 1], value(k[in.arg]), sp - 1);
+				break;
+			case opcode::mul_const:
+				stack[sp - 1] = binary(opcode::mul, stack[sp - 1], value(k[in.arg]), sp - 1);
+				break;
+			case opcode::div_const:
+				stack[sp - 1] = binary(opcode::div, stack[sp - 1], value(k[in.arg]), sp - 1);
+				break;
+			case opcode::add_var:
+				stack[sp - 1] = binary(opcode::add, stack[sp - 1], variable(in.arg), sp - 1);
+				break;
+			case opcode::sub_var:
+				stack[sp - 1] = binary(opcode::sub, stack[sp - 1], variable(in.arg), sp - 1);
+				break;
+			case opcode::mul_var:
+				stack[sp - 1] = binary(opcode::mul, stack[sp - 1], variable(in.arg), sp - 1);
+				break;
+			case opcode::div_var:
+				stack[sp - 1] = binary(opcode::div, stack[sp - 1], variable(in.arg), sp - 1);
+				break;
+			case opcode::add_vars:
+			case opcode::sub_vars:
+			case opcode::mul_vars:
+			case opcode::div_vars: {
+				opcode op = opcode::add;
+				if (in.op == opcode::sub_vars) op = opcode::sub;
+				if (in.op == opcode::mul_vars) op = opcode::mul;
+				if (in.op == opcode::div_vars) op = opcode::div;
+				stack[sp] = binary(op, variable(in.arg >> 16),
+					variable(in.arg & 0xffff), sp);
+				++sp;
+				break;
+			}
+			case opcode::add_add:
+			case opcode::mul_mul:
+			case opcode::mul_add:
+			case opcode::mul_sub: {
+				// x op1 (y op2 z)
+				opcode inner = (in.op == opcode::add_add) ? opcode::add : opcode::mul;
+				opcode outer = opcode::add;
+				if (in.op == opcode::mul_mul) outer = opcode::mul;
+				if (in.op == opcode::mul_sub) outer = opcode::sub;
+				stack[sp - 2] = binary(inner, stack[sp - 2], stack[sp - 1], sp - 2);
+				stack[sp - 3] = binary(outer, stack[sp - 3], stack[sp - 2], sp - 3);
+				sp -= 2;
+				break;
+			}
+			case opcode::reduce_add:
+			case opcode::reduce_mul: {
+				opcode op = (in.op == opcode::reduce_add) ? opcode::add : opcode::mul;
+				sp -= in.arg;
+				pairwise_order(sp, in.arg, [&](size_t dst, size_t src) {
+					stack[dst] = binary(op, stack[dst], stack[src], dst);
+					return true;
+				});
+				++sp;
+				break;
+			}
+		}
+	}
+	const column_operand& r = stack[0];
+	if (r.scalar) {
+		for (size_t i = 0; i < n; ++i) out[i] = r.value;
+	}
+	else if (r.data != out) {
+		copy(r.data, r.data + n, out);
+	}
+}
+
+/*  ~ Canonical operand order ~
+
+	a+b and b+a are different token sequences, so they would compile to
+	different programs and miss each other in the cache. With
+	compile_options::canonical the operands of every + and * are ordered
+	by a structural hash of their subtrees (names by text, literals only
+	by kind, so the order is the same for every expression of a shape).
+	Equal hashes keep the text order. Swapping the two operands of one
+	IEEE addition or multiplication does not change its result, so this
+	is exact. With pairwise chains the operands of a node that has a
+	parent or a child of its own operator stay in place: a swap there
+	would move a chain off the left operands or reorder the terms of a
+	reduction, which rounds by term position.
+	compile_options::canonical_chains also sorts all terms of a chain of
+	one operator, a+b+c and c+a+b become one program; that regroups the
+	operations and may change the rounding. */
+
+const size_t no_node = (size_t)-1;
+
+class canonical_node {
+public:
+	size_t token{};
+	size_t left{ no_node };
+	size_t right{ no_node };
+	unsigned long long hash{};
+	// with chains: sum of the hashes of the chain terms below the node
+	unsigned long long sum{};
+};
+
+unsigned long long mix_hash(unsigned long long x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+unsigned long long combine_hash(unsigned long long seed, unsigned long long v) {
+	return mix_hash(seed ^ (v + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+}
+
+// postfix tokens with + and * operands in canonical order, keep_chains
+// leaves the chains of compiler::reassociate() as they are
+token_list canonical_postfix(const token_list& postfix, bool chains, bool keep_chains) {
+	auto commutative = [](token_type t) {
+		return t == token_type::op_add || t == token_type::op_mul;
+	};
+	vector<canonical_node> nodes(postfix.size());
+	vector<size_t> operands;
+	// nodes in a chain of one operator, never swapped with keep_chains
+	vector<bool> chained(postfix.size());
+	if (keep_chains) {
+		for (size_t i = 0; i < postfix.size(); ++i) {
+			token_type t = postfix[i].type;
+			if (t == token_type::number || t == token_type::identifier) {
+				operands.push_back(i);
+				continue;
+			}
+			if (operands.size() < 2) return postfix;
+			for (int k = 0; k < 2; ++k) {
+				size_t c = operands.back();
+				operands.pop_back();
+				if (postfix[c].type == t) chained[i] = chained[c] = true;
+			}
+			operands.push_back(i);
+		}
+		operands.clear();
+	}
+	for (size_t i = 0; i < postfix.size(); ++i) {
+		const token& t = postfix[i];
+		canonical_node& n = nodes[i];
+		n.token = i;
+		if (t.type == token_type::number) {
+			long long value{};
+			n.hash = mix_hash(integer_literal(t.text, value) ? 1 : 2);
+		}
+		else if (t.type == token_type::identifier) {
+			unsigned long long h = fnv_offset;
+			for (char c : t.text) h = (h ^ (unsigned char)c) * fnv_prime;
+			n.hash = mix_hash(h);
+		}
+		else {
+			n.right = operands.back();
+			operands.pop_back();
+			n.left = operands.back();
+			operands.pop_back();
+			unsigned long long op = (unsigned long long)t.type;
+			const canonical_node& l = nodes[n.left];
+			const canonical_node& r = nodes[n.right];
+			if (commutative(t.type) && chains) {
+				// the same hash for every order and grouping of the terms
+				auto part = [&](const canonical_node& c) {
+					return postfix[c.token].type == t.type ? c.sum : c.hash;
+				};
+				n.sum = part(l) + part(r);
+				n.hash = combine_hash(op, n.sum);
+			}
+			else {
+				if (commutative(t.type) && not chained[i] && r.hash < l.hash)
+					swap(n.left, n.right);
+				n.hash = combine_hash(combine_hash(op, nodes[n.left].hash),
+					nodes[n.right].hash);
+			}
+		}
+		operands.push_back(i);
+	}
+	token_list out;
+	out.reserve(postfix.size());
+	if (operands.size() != 1) return postfix;
+	// nodes to emit, true emits just the operator of the node
+	vector<pair<size_t, bool>> work{ { operands.back(), false } };
+	vector<size_t> terms;
+	vector<size_t> open;
+	auto by_hash = [&nodes](size_t x, size_t y) { return nodes[x].hash < nodes[y].hash; };
+	while (not work.empty()) {
+		pair<size_t, bool> w = work.back();
+		work.pop_back();
+		const canonical_node& n = nodes[w.first];
+		if (w.second || n.left == no_node) {
+			out.push_back(postfix[n.token]);
+			continue;
+		}
+		token_type type = postfix[n.token].type;
+		if (chains && commutative(type)) {
+			// terms of the chain in text order, sorted, then
+			// t0 t1 op t2 op ... pushed in reverse
+			terms.clear();
+			open.assign(1, w.first);
+			while (not open.empty()) {
+				size_t c = open.back();
+				open.pop_back();
+				if (postfix[nodes[c].token].type == type) {
+					open.push_back(nodes[c].right);
+					open.push_back(nodes[c].left);
+				}
+				else terms.push_back(c);
+			}
+			stable_sort(terms.begin(), terms.end(), by_hash);
+			for (size_t k = terms.size(); k-- > 1;) {
+				work.push_back({ w.first, true });
+				work.push_back({ terms[k], false });
+			}
+			work.push_back({ terms[0], false });
+			continue;
+		}
+		work.push_back({ w.first, true });
+		work.push_back({ n.right, false });
+		work.push_back({ n.left, false });
+	}
+	return out;
+}
+
+class eval {
+private:
+	token_list tokens;
+	compile_options options;
+	program prog;
+	bool postfixed;
+	bool compiled;
+	bool error;
+	double result;
+	bool integer;
+	long long integer_result;
+	// returns operator precedence
+	int precedence(const token& tk);
+	bool is_number(const token& tk);
+	bool is_identifier(const token& tk);
+	bool is_operator(const token& tk);
+	bool is_bracket(const token& tk);
+	bool is_open_bracket(const token& tk);
+	bool is_close_bracket(const token& tk);
+	// returns true if bracket is found
+	bool check_infix_for_brackets(const token_list& tl);
+	// reorder tokens to postfix notation
+	void to_postfix();
+public:
+	eval(const tokenizer& t, const compile_options& opt = {});
+	eval(const token_list& t, const compile_options& opt = {});
+	// starts over with new tokens, keeps allocated memory
+	void reset(const token_list& t);
+	bool error_state();
+	token_list get_tokens() const;
+	const token_list& tokens_ref() const;
+	program get_program() const;
+	double get_result();
+	// the result is an exact 64-bit integer
+	bool is_integer();
+	long long get_integer_result();
+	// reorders the tokens to postfix notation, canonical operand order
+	// with compile_options::canonical
+	void postfix();
+	// translates tokens to bytecode
+	void compile();
+	// values[] holds one value per variable slot of the program
+	void solve(const double* values = nullptr);
+};
+
+eval::eval(const tokenizer& tk, const compile_options& opt)
+	: tokens{ tk.get_tokens() }, options{ opt }, prog{}, postfixed{},
+	compiled{}, error{}, result{}, integer{}, integer_result{} {}
+
+eval::eval(const token_list& t, const compile_options& opt):
+	tokens{ t }, options{ opt }, prog{}, postfixed{}, compiled{}, error{},
+	result{}, integer{}, integer_result{} {}
+
+void eval::reset(const token_list& t) {
+	tokens = t;
+	prog.code.clear();
+	prog.constants.clear();
+	prog.slots.clear();
+	prog.int_constants.clear();
+	prog.forks.clear();
+	postfixed = false;
+	compiled = false;
+	error = false;
+	result = 0;
+	integer = false;
+	integer_result = 0;
+}
+
+token_list eval::get_tokens() const { return tokens; }
+const token_list& eval::tokens_ref() const { return tokens; }
+program eval::get_program() const { return prog; }
+bool eval::error_state() { return error; }
+double eval::get_result() { return result; }
+bool eval::is_integer() { return integer; }
+long long eval::get_integer_result() { return integer_result; }
+
+int eval::precedence(const token& tk) {
+	int precedence = -1;
+	switch(tk.type) {
+		case token_type::op_add:
+		case token_type::op_sub:
+			precedence = 10;
+			break;
+		case token_type::op_mul:
+		case token_type::op_div:
+			precedence = 20;
+			break;
+	}
+	return precedence;
+}
+
+bool eval::is_number(const token& tk) {
+	return (tk.type == token_type::number);
+}
+
+bool eval::is_identifier(const token& tk) {
+	return (tk.type == token_type::identifier);
+}
+
+bool eval::is_operator(const token& tk) {
+	if(tk.type == token_type::op_add) return true;
+	if(tk.type == token_type::op_sub) return true;
+	if(tk.type == token_type::op_mul) return true;
+	if(tk.type == token_type::op_div) return true;
+	return false;
+}
+
+bool eval::is_bracket(const token& tk) {
+	if (is_open_bracket(tk)) return true;
+	if (is_close_bracket(tk)) return true;
+	return false;
+}
+
+bool eval::is_open_bracket(const token& tk) {
+	return (tk.type == token_type::open_bracket);
+}
+
+bool eval::is_close_bracket(const token& tk) {
+	return (tk.type == token_type::close_bracket);
+}
+
+/*  ~ The Shunting Yard Algorithm ~
+
+       While there are tokens to be read:
+       Read a token
+       If it's a number add it to queue
+       If it's an operator
+              While there's an operator on the top of the stack with greater
+              or equal precedence:
+                      Pop operators from the stack onto the output queue
+              Push the current operator onto the stack
+       If it's a left bracket push it onto the stack
+       If it's a right bracket 
+            While there's not a left bracket at the top of the stack:
+				Pop operators from the stack onto the output queue.
+             Pop the left bracket from the stack and discard it
+	While there are operators on the stack, pop them to the queue */
+
+void eval::to_postfix() {
+	// input in infix notation
+	token_list input { tokens };
+	// output in postfix notation
+	token_list output {};
+	// stack of operators
+	stack<token, token_list> op_stack{};
+
+	// we reading token list from left to right
+	for (token term : input) {
+		// current token is the number or the variable
+		if (is_number(term) || is_identifier(term)) {
+			output.push_back(term);
+			continue;
+		}
+		// current token is the operator
+		if (is_operator(term)) {
+			// if the stack is empty
+			if (op_stack.empty()) {
+				op_stack.push(term);
+				continue;
+			}
+			// if there are brackets on the top of the stack
+			if (is_bracket(op_stack.top())) {
+				op_stack.push(term);
+				continue;
+			}
+			// checking operators priority, operators of equal priority
+			// are left associative
+			while (not op_stack.empty() && not is_bracket(op_stack.top()) &&
+				precedence(term) <= precedence(op_stack.top())) {
+				output.push_back(op_stack.top());
+				op_stack.pop();
+			}
+			op_stack.push(term);
+			continue;
+		}
+		// current token is the bracket
+		if (is_bracket(term)) {
+			if (is_open_bracket(term)) {
+				op_stack.push(term);
+				continue;
+			}
+			if (is_close_bracket(term)) {
+				while (not op_stack.empty()) {
+					if (is_open_bracket(op_stack.top())) {
+						op_stack.pop();
+						break;
+					}
+					if (not is_bracket(op_stack.top())) {
+						output.push_back(op_stack.top());
+					}
+					op_stack.pop();
+				}
+				continue;
+			}
+		}
+		// we must never get to this point
+		error = true;
+		break;
+	}
+	// finalization
+	while (not op_stack.empty()) {
+		output.push_back(op_stack.top());
+		op_stack.pop();
+	}
+	tokens.assign(output.begin(), output.end());
+	if (check_infix_for_brackets(tokens)) error = true;
+}
+
+bool eval::check_infix_for_brackets(const token_list& tl) {
+	for (token term : tl)
+		if (is_bracket(term)) return true;
+	return false;
+}
+
+void eval::postfix() {
+	if (postfixed) return;
+	postfixed = true;
+	this->to_postfix();
+	if (error) return;
+	if (options.canonical || options.canonical_chains)
+		tokens = canonical_postfix(tokens, options.canonical_chains,
+			options.pairwise_terms > 1);
+}
+
+void eval::compile() {
+	if (compiled) return;
+	compiled = true;
+	this->postfix();
+	if (error) return;
+	compiler cc(tokens, options);
+	cc.compile();
+	if (cc.error_state()) {
+		error = true;
+		return;
+	}
+	prog = cc.get_program();
+}
+
+void eval::solve(const double* values) {
+	this->compile();
+	if (error) return;
+	// unbound variables
+	if (not prog.slots.empty() && values == nullptr) {
+		error = true;
+		return;
+	}
+	// exact integer path, double arithmetic on overflow
+	if (not prog.forks.empty()) {
+		thread_pool& pool = shared_pool();
+		integer = prog.integer && prog.run_integer_parallel(pool, integer_result, values);
+		if (integer) this->result = (double)integer_result;
+		else this->result = prog.run_parallel(pool, values);
+		return;
+	}
+	integer = prog.integer && prog.run_integer(integer_result, values);
+	if (integer) this->result = (double)integer_result;
+	else this->result = prog.run(values);
+}
+
+
+void string_strip(string& str) {
+	while (str.size() > 0 && isspace(str[0])) str.erase(str.begin());
+	while (str.size() > 0 && isspace(str[str.size() - 1])) str.erase(str.end() - 1);
+}
+
+// read-only view of a whole file
+class mapped_file {
+private:
+	const char* bytes;
+	size_t length;
+	bool mapped;
+	// files that cannot be mapped are read into memory
+	vector<char> copy;
+public:
+	mapped_file();
+	~mapped_file();
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	bool open(const string& path);
+	const char* data() const;
+	size_t size() const;
+};
+
+mapped_file::mapped_file() : bytes{}, length{}, mapped{}, copy{} {}
+
+mapped_file::~mapped_file() {
+#ifndef _WIN32
+	if (mapped) munmap((void*)bytes, length);
+#endif
+}
+
+bool mapped_file::open(const string& path) {
+#ifndef _WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st {};
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+			bytes = (const char*)p;
+			length = (size_t)st.st_size;
+			mapped = true;
+		}
+	}
+	::close(fd);
+	if (mapped) return true;
+#endif
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f == nullptr) return false;
+	char block[1 << 16];
+	size_t n{};
+	while ((n = fread(block, 1, sizeof(block), f)) > 0)
+		copy.insert(copy.end(), block, block + n);
+	fclose(f);
+	bytes = copy.data();
+	length = copy.size();
+	return true;
+}
+
+const char* mapped_file::data() const { return bytes; }
+size_t mapped_file::size() const { return length; }
+
+/*  ~ Compact program cache file ~
+
+	--cache-file PATH keeps the shape programs of the cache between runs
+	in a compact, portable file. It is not an image of program objects:
+	the file is mapped at startup, and a shape found there has its
+	record checked (checksum, valid_program()) and decoded field by field
+	into a new program, which then stays in the memory cache like a
+	compiled one. A shape costs one decode per run instead of tokenizing
+	and compiling. At the end of a run that compiled new shapes the file
+	is rewritten (to a temporary file, then renamed) with its old and
+	the new programs. All numbers are little endian, all positions are
+	offsets from the start of the file, records are 8 byte aligned:
+
+		header, 64 bytes
+		char     magic[8]       "SEVPROGS"
+		uint32   version        1
+		uint32   header_size    64
+		uint64   options        fingerprint of the compile_options
+		uint64   table_offset
+		uint64   table_slots    power of two
+		uint64   records
+		uint64   file_size
+		uint64   reserved       0
+
+		table, table_slots entries, linear probing from hash & (slots - 1)
+		uint64   shape hash     expression_shape::hash
+		uint64   record         offset, 0 for an empty slot
+
+		record
+		uint32   size           of the whole record
+		uint32   checksum       FNV-1a of the bytes after it, low 32 bits
+		uint32   shape_size
+		uint32   code_count
+		uint32   slot_count
+		uint32   constant_count
+		uint32   int_constant_count
+		uint32   stack_size
+		uint32   flags          bit 0: integer program
+		uint32   reserved       0
+		char     shape[shape_size], zero padded to 8
+		code_count times   uint32 opcode, uint32 arg
+		double   constants[constant_count]
+		int64    int_constants[int_constant_count]
+		slot_count times   uint32 length, char name[length]
+		zero padded to 8
+
+	A file of another version or written with other compile options is
+	ignored, a record with a wrong checksum or an invalid program is a
+	miss. Programs with fork tasks are not stored. */
+
+const char program_file_magic[8] = { 'S', 'E', 'V', 'P', 'R', 'O', 'G', 'S' };
+const unsigned program_file_version = 1;
+const size_t program_file_header = 64;
+const size_t program_record_header = 40;
+
+void put_le(string& out, unsigned long long v, int bytes) {
+	for (int i = 0; i < bytes; ++i) out += (char)((v >> (8 * i)) & 0xff);
+}
+
+unsigned long long get_le(const char* p, int bytes) {
+	unsigned long long v = 0;
+	for (int i = bytes - 1; i >= 0; --i) v = (v << 8) | (unsigned char)p[i];
+	return v;
+}
+
+// arguments in range and a balanced stack, so a damaged file cannot crash
+bool valid_program(const program& p) {
+	if (p.stack_size > p.code.size()) return false;
+	size_t depth = 0;
+	for (const instruction& in : p.code) {
+		if (in.op > opcode::reduce_mul) return false;
+		switch (in.op) {
+			case opcode::push:
+			case opcode::add_const:
+			case opcode::sub_const:
+			case opcode::mul_const:
+			case opcode::div_const:
+				if (in.arg >= p.constants.size()) return false;
+				if (p.integer && in.arg >= p.int_constants.size()) return false;
+				break;
+			case opcode::load:
+			case opcode::add_var:
+			case opcode::sub_var:
+			case opcode::mul_var:
+			case opcode::div_var:
+				if (in.arg >= p.slots.size()) return false;
+				break;
+			case opcode::add_vars:
+			case opcode::sub_vars:
+			case opcode::mul_vars:
+			case opcode::div_vars:
+				if ((in.arg >> 16) >= p.slots.size() || (in.arg & 0xffff) >= p.slots.size())
+					return false;
+				break;
+			case opcode::reduce_add:
+			case opcode::reduce_mul:
+				if (in.arg < 2) return false;
+				break;
+			default:
+				break;
+		}
+		size_t n = instruction_arity(in);
+		if (depth < n) return false;
+		depth = depth - n + 1;
+		if (depth > p.stack_size) return false;
+	}
+	return depth == 1;
+}
+
+// appends the record of a program
+void write_program_record(string& out, const string& shape, const program& p) {
+	size_t start = out.size();
+	put_le(out, 0, 8);
+	put_le(out, shape.size(), 4);
+	put_le(out, p.code.size(), 4);
+	put_le(out, p.slots.size(), 4);
+	put_le(out, p.constants.size(), 4);
+	put_le(out, p.int_constants.size(), 4);
+	put_le(out, p.stack_size, 4);
+	put_le(out, p.integer ? 1 : 0, 4);
+	put_le(out, 0, 4);
+	out += shape;
+	out.resize((out.size() + 7) & ~(size_t)7, '\0');
+	for (const instruction& in : p.code) {
+		put_le(out, (unsigned)in.op, 4);
+		put_le(out, in.arg, 4);
+	}
+	for (double c : p.constants) {
+		unsigned long long bits{};
+		memcpy(&bits, &c, 8);
+		put_le(out, bits, 8);
+	}
+	for (long long c : p.int_constants) put_le(out, (unsigned long long)c, 8);
+	for (const string& s : p.slots) {
+		put_le(out, s.size(), 4);
+		out += s;
+	}
+	out.resize((out.size() + 7) & ~(size_t)7, '\0');
+	size_t size = out.size() - start;
+	unsigned long long h = fnv_offset;
+	for (size_t i = start + 8; i < out.size(); ++i) h = (h ^ (unsigned char)out[i]) * fnv_prime;
+	for (int i = 0; i < 4; ++i) {
+		out[start + i] = (char)((size >> (8 * i)) & 0xff);
+		out[start + 4 + i] = (char)((h >> (8 * i)) & 0xff);
+	}
+}
+
+class program_cache;
+
+class program_file {
+private:
+	mapped_file file;
+	unsigned long long fingerprint;
+	size_t table_offset;
+	size_t table_slots;
+	// record at offset, nullptr if it is out of bounds or damaged
+	const char* record(size_t offset) const;
+public:
+	program_file(const compile_options& opt);
+	// maps a cache file, false if it is missing or not usable
+	bool open(const string& path);
+	// program of a shape stored in the file, nullptr if there is none
+	shared_ptr<program> find(const expression_shape& shape) const;
+	// writes the programs of the file and the shapes of the cache to path
+	bool save(const string& path, const program_cache& cache) const;
+};
+
+// programs depend on the compile options
+unsigned long long options_fingerprint(const compile_options& opt) {
+	unsigned long long h = fnv_offset;
+	for (unsigned long long v : { (unsigned long long)opt.fuse,
+		(unsigned long long)opt.integer, (unsigned long long)opt.fork_threshold,
+		(unsigned long long)opt.pairwise_terms, (unsigned long long)opt.canonical,
+		(unsigned long long)opt.canonical_chains })
+		h = combine_hash(h, v);
+	return h;
+}
+
+program_file::program_file(const compile_options& opt)
+	: file{}, fingerprint{ options_fingerprint(opt) }, table_offset{},
+	table_slots{} {}
+
+bool program_file::open(const string& path) {
+	table_slots = 0;
+	if (not file.open(path)) return false;
+	const char* p = file.data();
+	size_t size = file.size();
+	if (size < program_file_header || memcmp(p, program_file_magic, 8) != 0) return false;
+	if (get_le(p + 8, 4) != program_file_version || get_le(p + 16, 8) != fingerprint)
+		return false;
+	size_t offset = (size_t)get_le(p + 24, 8);
+	size_t slots = (size_t)get_le(p + 32, 8);
+	if (get_le(p + 48, 8) != size || slots == 0 || (slots & (slots - 1)) != 0) return false;
+	if (offset < program_file_header || offset > size || slots > (size - offset) / 16)
+		return false;
+	table_offset = offset;
+	table_slots = slots;
+	return true;
+}
+
+const char* program_file::record(size_t offset) const {
+	if (offset < program_file_header || offset % 8 != 0 ||
+		offset > file.size() - program_record_header) return nullptr;
+	const char* r = file.data() + offset;
+	size_t size = (size_t)get_le(r, 4);
+	if (size < program_record_header || size > file.size() - offset ||
+		get_le(r + 8, 4) > size - program_record_header) return nullptr;
+	unsigned long long h = fnv_offset;
+	for (size_t i = 8; i < size; ++i) h = (h ^ (unsigned char)r[i]) * fnv_prime;
+	if (get_le(r + 4, 4) != (h & 0xffffffff)) return nullptr;
+	return r;
+}
+
+shared_ptr<program> program_file::find(const expression_shape& shape) const {
+	if (table_slots == 0) return nullptr;
+	const char* table = file.data() + table_offset;
+	for (size_t i = 0; i < table_slots; ++i) {
+		const char* slot = table + 16 * ((shape.hash + i) & (table_slots - 1));
+		size_t offset = (size_t)get_le(slot + 8, 8);
+		if (offset == 0) return nullptr;
+		if (get_le(slot, 8) != shape.hash) continue;
+		const char* r = record(offset);
+		if (r == nullptr) continue;
+		size_t text_size = (size_t)get_le(r + 8, 4);
+		if (text_size != shape.text.size() ||
+			memcmp(r + program_record_header, shape.text.data(), text_size) != 0) continue;
+		const char* end = r + get_le(r, 4);
+		size_t code = (size_t)get_le(r + 12, 4);
+		size_t slots = (size_t)get_le(r + 16, 4);
+		size_t constants = (size_t)get_le(r + 20, 4);
+		size_t int_constants = (size_t)get_le(r + 24, 4);
+		unsigned flags = (unsigned)get_le(r + 32, 4);
+		const char* q = r + program_record_header + ((text_size + 7) & ~(size_t)7);
+		if (q > end || (size_t)(end - q) / 8 < code + constants + int_constants ||
+			flags > 1) return nullptr;
+		shared_ptr<program> p = make_shared<program>();
+		p->stack_size = (size_t)get_le(r + 28, 4);
+		p->integer = flags == 1;
+		p->code.resize(code);
+		for (instruction& in : p->code) {
+			in.op = (opcode)get_le(q, 4);
+			in.arg = (unsigned)get_le(q + 4, 4);
+			q += 8;
+		}
+		p->constants.resize(constants);
+		for (double& c : p->constants) {
+			unsigned long long bits = get_le(q, 8);
+			memcpy(&c, &bits, 8);
+			q += 8;
+		}
+		p->int_constants.resize(int_constants);
+		for (long long& c : p->int_constants) {
+			c = (long long)get_le(q, 8);
+			q += 8;
+		}
+		for (size_t s = 0; s < slots; ++s) {
+			if (end - q < 4) return nullptr;
+			size_t n = (size_t)get_le(q, 4);
+			q += 4;
+			if ((size_t)(end - q) < n) return nullptr;
+			p->slots.emplace_back(q, n);
+			q += n;
+		}
+		if (not valid_program(*p)) return nullptr;
+		return p;
+	}
+	return nullptr;
+}
+
+/*  ~ Program cache ~
+
+	Expression streams repeat the same text, and even more often the
+	same formula with other numbers. program_cache keeps compiled
+	programs under two keys:
+	 - the text without the blanks the tokenizer ignores (one blank
+	   stays between two name or number characters, "a b" is not "ab").
+	   A hit skips the tokenizer, to_postfix and the compiler;
+	 - the shape of the tokens: names and operators, every literal
+	   replaced by # (integer) or $ (other number), hashed by the
+	   tokenizer while it reads the line. A hit skips to_postfix and the
+	   compiler. The compiler numbers constants in text order, the same
+	   order as the literals of the shape, so one program runs every
+	   expression of its shape with the literals of that expression:
+	   1.5*(3+x) and 2.25*(7+x) share a program.
+	The cache is bounded by the memory of its entries and drops the
+	least recently used entry first. Programs are shared: an evicted
+	program stays valid while a caller or a text entry holds it. Every
+	member locks, so one cache may serve several threads. */
+
+class cache_stats {
+public:
+	// results found by the result_cache of line evaluators
+	size_t result_hits{};
+	// found by text
+	size_t hits{};
+	// found by shape
+	size_t shape_hits{};
+	// found in the cache file
+	size_t file_hits{};
+	size_t misses{};
+	size_t evictions{};
+	size_t entries{};
+	size_t bytes{};
+	void print(ostream& out) const;
+};
+
+void cache_stats::print(ostream& out) const {
+	size_t found = result_hits + hits + shape_hits + file_hits;
+	out << "cache: " << result_hits << " result hits, " << hits << " text hits, "
+		<< shape_hits << " shape hits, "
+		<< file_hits << " file hits, " << misses << " misses";
+	if (found + misses > 0) out << " (" << (100.0 * found / (found + misses)) << "% hit rate)";
+	out << ", " << evictions << " evictions, " << entries << " entries, "
+		<< bytes << " bytes\n";
+}
+
+// approximate heap and object size of a program
+size_t program_bytes(const program& p) {
+	size_t bytes = sizeof(program) + p.code.capacity() * sizeof(instruction) +
+		p.constants.capacity() * sizeof(double) +
+		p.int_constants.capacity() * sizeof(long long);
+	for (const string& s : p.slots) bytes += sizeof(string) + s.capacity();
+	for (const fork_task& t : p.forks)
+		bytes += sizeof(fork_task) + (t.children.size() + t.pieces.size()) * sizeof(size_t);
+	return bytes;
+}
+
+// a program of the shape of an expression and the literals to run it with
+class prepared_expression {
+public:
+	shared_ptr<const program> prog{};
+	literal_values literals{};
+};
+
+class program_cache {
+private:
+	class entry {
+	public:
+		// normalized text, or the shape of a shape entry
+		string key;
+		bool shape{};
+		unsigned long long hash{};
+		// no literals in shape entries
+		prepared_expression expr;
+		size_t bytes{};
+	};
+	// most recently used first
+	list<entry> lru;
+	unordered_map<string, list<entry>::iterator> texts;
+	unordered_map<unsigned long long, list<entry>::iterator> shapes;
+	compile_options options;
+	size_t max_bytes;
+	cache_stats stats;
+	mutable mutex lock;
+	// shapes missing in memory are looked up there, may be null
+	const program_file* store;
+	// adds e unless it is bigger than the cache, evicts to make room
+	void add(entry& e);
+	void add_shape(const expression_shape& shape, shared_ptr<const program> prog);
+public:
+	program_cache(size_t max_bytes, const compile_options& opt = {});
+	// cache key of an expression
+	static void normalize(const string& text, string& key);
+	// program and literals of a normalized text, false on a miss
+	bool find(const string& key, prepared_expression& out);
+	// program of a shape, nullptr on a miss
+	shared_ptr<const program> find_shape(const expression_shape& shape);
+	// adds the text and, if new, the shape; prog must be compiled with
+	// get_options() from the tokens of the shape
+	void insert(const string& key, const expression_shape& shape,
+		shared_ptr<const program> prog);
+	// compiles the text through the cache, false on an error
+	bool get(const string& text, prepared_expression& out);
+	const compile_options& get_options() const;
+	cache_stats get_stats() const;
+	void count_results(size_t hits);
+	void clear();
+	// programs compiled with get_options(), see program_file
+	void set_store(const program_file* file);
+	// calls f(shape, program) for every shape in memory
+	void for_each_shape(const function<void(const expression_shape&, const program&)>& f) const;
+};
+
+program_cache::program_cache(size_t bytes, const compile_options& opt)
+	: lru{}, texts{}, shapes{}, options{ shape_options(opt) }, max_bytes{ bytes }, stats{},
+	lock{}, store{} {}
+
+void program_cache::normalize(const string& text, string& key) {
+	// ASCII classes of the C locale, on the path of every cached line
+	auto word = [](char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+			(c >= '0' && c <= '9') || c == '_' || c == '.';
+	};
+	// never longer than the text
+	key.resize(text.size());
+	char* out = &key[0];
+	size_t n = 0;
+	bool blank = false;
+	for (char c : text) {
+		if (c == ' ' || (c >= '\t' && c <= '\r')) {
+			blank = true;
+			continue;
+		}
+		if (blank && n > 0 && word(out[n - 1]) && word(c)) out[n++] = ' ';
+		blank = false;
+		out[n++] = c;
+	}
+	key.resize(n);
+}
+
+bool program_cache::find(const string& key, prepared_expression& out) {
+	lock_guard<mutex> g(lock);
+	auto it = texts.find(key);
+	if (it == texts.end()) return false;
+	++stats.hits;
+	lru.splice(lru.begin(), lru, it->second);
+	out.prog = it->second->expr.prog;
+	out.literals = it->second->expr.literals;
+	return true;
+}
+
+shared_ptr<const program> program_cache::find_shape(const expression_shape& shape) {
+	lock_guard<mutex> g(lock);
+	auto it = shapes.find(shape.hash);
+	// a hash collision is a miss
+	if (it == shapes.end() || it->second->key != shape.text) {
+		shared_ptr<const program> prog = store ? store->find(shape) : nullptr;
+		if (not prog) {
+			++stats.misses;
+			return nullptr;
+		}
+		++stats.file_hits;
+		if (it == shapes.end()) add_shape(shape, prog);
+		return prog;
+	}
+	++stats.shape_hits;
+	lru.splice(lru.begin(), lru, it->second);
+	return it->second->expr.prog;
+}
+
+void program_cache::add(entry& e) {
+	if (e.bytes > max_bytes) return;
+	while (stats.bytes + e.bytes > max_bytes) {
+		const entry& last = lru.back();
+		if (last.shape) shapes.erase(last.hash);
+		else texts.erase(last.key);
+		stats.bytes -= last.bytes;
+		lru.pop_back();
+		--stats.entries;
+		++stats.evictions;
+	}
+	stats.bytes += e.bytes;
+	++stats.entries;
+	lru.push_front(move(e));
+	if (lru.front().shape) shapes.emplace(lru.front().hash, lru.begin());
+	else texts.emplace(lru.front().key, lru.begin());
+}
+
+void program_cache::add_shape(const expression_shape& shape,
+	shared_ptr<const program> prog) {
+	entry e;
+	e.key = shape.text;
+	e.shape = true;
+	e.hash = shape.hash;
+	e.bytes = sizeof(entry) + sizeof(string) + e.key.capacity() +
+		program_bytes(*prog);
+	e.expr.prog = move(prog);
+	add(e);
+}
+
+void program_cache::insert(const string& key, const expression_shape& shape,
+	shared_ptr<const program> prog) {
+	const literal_values& lits = shape.literals;
+	lock_guard<mutex> g(lock);
+	if (shapes.count(shape.hash) == 0) add_shape(shape, prog);
+	if (texts.count(key) == 0) {
+		entry e;
+		e.key = key;
+		e.expr.prog = move(prog);
+		e.expr.literals = lits;
+		// the key is stored twice, in the entry and in the index
+		e.bytes = sizeof(entry) + 2 * (sizeof(string) + key.capacity()) +
+			lits.constants.capacity() * sizeof(double) +
+			lits.int_constants.capacity() * sizeof(long long);
+		add(e);
+	}
+}
+
+const compile_options& program_cache::get_options() const { return options; }
+
+cache_stats program_cache::get_stats() const {
+	lock_guard<mutex> g(lock);
+	return stats;
+}
+
+void program_cache::clear() {
+	lock_guard<mutex> g(lock);
+	lru.clear();
+	texts.clear();
+	shapes.clear();
+	stats.entries = 0;
+	stats.bytes = 0;
+}
+
+void program_cache::count_results(size_t hits) {
+	lock_guard<mutex> g(lock);
+	stats.result_hits += hits;
+}
+
+void program_cache::set_store(const program_file* file) {
+	lock_guard<mutex> g(lock);
+	store = file;
+}
+
+void program_cache::for_each_shape(
+	const function<void(const expression_shape&, const program&)>& f) const {
+	lock_guard<mutex> g(lock);
+	expression_shape shape;
+	for (const entry& e : lru) {
+		if (not e.shape) continue;
+		shape.text = e.key;
+		shape.hash = e.hash;
+		f(shape, *e.expr.prog);
+	}
+}
+
+bool program_file::save(const string& path, const program_cache& cache) const {
+	// hash and record of every program, the cache's first: a shape the
+	// file stores under a damaged hash gets its hash back
+	vector<pair<unsigned long long, string>> records;
+	unordered_set<string> known;
+	cache.for_each_shape([&](const expression_shape& shape, const program& p) {
+		if (not p.forks.empty() || known.count(shape.text) != 0) return;
+		known.insert(shape.text);
+		string record;
+		write_program_record(record, shape.text, p);
+		records.emplace_back(shape.hash, move(record));
+	});
+	const char* table = file.data() + table_offset;
+	for (size_t i = 0; i < table_slots; ++i) {
+		size_t offset = (size_t)get_le(table + 16 * i + 8, 8);
+		const char* r = offset == 0 ? nullptr : record(offset);
+		if (r == nullptr) continue;
+		string shape(r + program_record_header, (size_t)get_le(r + 8, 4));
+		if (known.count(shape) != 0) continue;
+		known.insert(shape);
+		records.emplace_back(get_le(table + 16 * i, 8), string(r, (size_t)get_le(r, 4)));
+	}
+	size_t slots = 16;
+	while (slots < 2 * records.size()) slots *= 2;
+	string out;
+	out.append(program_file_magic, 8);
+	put_le(out, program_file_version, 4);
+	put_le(out, program_file_header, 4);
+	put_le(out, fingerprint, 8);
+	put_le(out, program_file_header, 8);
+	put_le(out, slots, 8);
+	put_le(out, records.size(), 8);
+	put_le(out, 0, 8);
+	put_le(out, 0, 8);
+	out.resize(program_file_header + 16 * slots, '\0');
+	for (const pair<unsigned long long, string>& r : records) {
+		size_t offset = out.size();
+		out += r.second;
+		size_t i = r.first & (slots - 1);
+		while (get_le(&out[program_file_header + 16 * i + 8], 8) != 0) i = (i + 1) & (slots - 1);
+		for (int b = 0; b < 8; ++b) {
+			out[program_file_header + 16 * i + b] = (char)((r.first >> (8 * b)) & 0xff);
+			out[program_file_header + 16 * i + 8 + b] = (char)((offset >> (8 * b)) & 0xff);
+		}
+	}
+	for (int b = 0; b < 8; ++b) out[48 + b] = (char)((out.size() >> (8 * b)) & 0xff);
+	// replace the file in one step, readers keep their mapping
+	string temp = path + ".tmp" + to_string(chrono::steady_clock::now().time_since_epoch().count());
+	FILE* f = fopen(temp.c_str(), "wb");
+	if (f == nullptr) return false;
+	bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+	ok = (fclose(f) == 0) && ok;
+#ifdef _WIN32
+	if (ok) remove(path.c_str());
+#endif
+	if (ok) ok = rename(temp.c_str(), path.c_str()) == 0;
+	if (not ok) remove(temp.c_str());
+	return ok;
+}
+
+
+/*  ~ Shortest round trip formatting ~
+
+	Results are printed with the fewest significant digits that read back
+	to the same double (strtod(text) == value), so no precision is lost
+	and no noise digits are printed. The digits come from Grisu3
+	(Florian Loitsch, "Printing floating-point numbers quickly and
+	accurately with integers", 2010): one 64-bit multiplication by a
+	cached power of ten and integer digit generation. Grisu3 knows when
+	it cannot prove its digits are the shortest (about 0.5% of doubles),
+	those take the slow path of printf with increasing precision. The
+	text is written straight into the caller's buffer, independent of
+	the locale. */
+
+// "do it yourself" floating point: f * 2^e
+class diy_fp {
+public:
+	unsigned long long f{};
+	int e{};
+};
+
+diy_fp diy_normalize(diy_fp x) {
+	while ((x.f & 0xffc0000000000000ULL) == 0) {
+		x.f <<= 10;
+		x.e -= 10;
+	}
+	while ((x.f & 0x8000000000000000ULL) == 0) {
+		x.f <<= 1;
+		x.e -= 1;
+	}
+	return x;
+}
+
+// upper 64 bits of the 128-bit product, rounded
+diy_fp diy_multiply(const diy_fp& x, const diy_fp& y) {
+	const unsigned long long m32 = 0xffffffffULL;
+	unsigned long long a = x.f >> 32, b = x.f & m32;
+	unsigned long long c = y.f >> 32, d = y.f & m32;
+	unsigned long long ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	unsigned long long t = (bd >> 32) + (ad & m32) + (bc & m32) + (1ULL << 31);
+	diy_fp r;
+	r.f = ac + (ad >> 32) + (bc >> 32) + (t >> 32);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+// normalized 10^k for k = -348, -340, ..., 340
+class cached_power {
+public:
+	unsigned long long f;
+	short e;
+	short k;
+};
+
+const cached_power cached_powers[] = {
+	{ 0xfa8fd5a0081c0288ULL, -1220, -348 },
+	{ 0xbaaee17fa23ebf76ULL, -1193, -340 },
+	{ 0x8b16fb203055ac76ULL, -1166, -332 },
+	{ 0xcf42894a5dce35eaULL, -1140, -324 },
+	{ 0x9a6bb0aa55653b2dULL, -1113, -316 },
+	{ 0xe61acf033d1a45dfULL, -1087, -308 },
+	{ 0xab70fe17c79ac6caULL, -1060, -300 },
+	{ 0xff77b1fcbebcdc4fULL, -1034, -292 },
+	{ 0xbe5691ef416bd60cULL, -1007, -284 },
+	{ 0x8dd01fad907ffc3cULL, -980, -276 },
+	{ 0xd3515c2831559a83ULL, -954, -268 },
+	{ 0x9d71ac8fada6c9b5ULL, -927, -260 },
+	{ 0xea9c227723ee8bcbULL, -901, -252 },
+	{ 0xaecc49914078536dULL, -874, -244 },
+	{ 0x823c12795db6ce57ULL, -847, -236 },
+	{ 0xc21094364dfb5637ULL, -821, -228 },
+	{ 0x9096ea6f3848984fULL, -794, -220 },
+	{ 0xd77485cb25823ac7ULL, -768, -212 },
+	{ 0xa086cfcd97bf97f4ULL, -741, -204 },
+	{ 0xef340a98172aace5ULL, -715, -196 },
+	{ 0xb23867fb2a35b28eULL, -688, -188 },
+	{ 0x84c8d4dfd2c63f3bULL, -661, -180 },
+	{ 0xc5dd44271ad3cdbaULL, -635, -172 },
+	{ 0x936b9fcebb25c996ULL, -608, -164 },
+	{ 0xdbac6c247d62a584ULL, -582, -156 },
+	{ 0xa3ab66580d5fdaf6ULL, -555, -148 },
+	{ 0xf3e2f893dec3f126ULL, -529, -140 },
+	{ 0xb5b5ada8aaff80b8ULL, -502, -132 },
+	{ 0x87625f056c7c4a8bULL, -475, -124 },
+	{ 0xc9bcff6034c13053ULL, -449, -116 },
+	{ 0x964e858c91ba2655ULL, -422, -108 },
+	{ 0xdff9772470297ebdULL, -396, -100 },
+	{ 0xa6dfbd9fb8e5b88fULL, -369, -92 },
+	{ 0xf8a95fcf88747d94ULL, -343, -84 },
+	{ 0xb94470938fa89bcfULL, -316, -76 },
+	{ 0x8a08f0f8bf0f156bULL, -289, -68 },
+	{ 0xcdb02555653131b6ULL, -263, -60 },
+	{ 0x993fe2c6d07b7facULL, -236, -52 },
+	{ 0xe45c10c42a2b3b06ULL, -210, -44 },
+	{ 0xaa242499697392d3ULL, -183, -36 },
+	{ 0xfd87b5f28300ca0eULL, -157, -28 },
+	{ 0xbce5086492111aebULL, -130, -20 },
+	{ 0x8cbccc096f5088ccULL, -103, -12 },
+	{ 0xd1b71758e219652cULL, -77, -4 },
+	{ 0x9c40000000000000ULL, -50, 4 },
+	{ 0xe8d4a51000000000ULL, -24, 12 },
+	{ 0xad78ebc5ac620000ULL, 3, 20 },
+	{ 0x813f3978f8940984ULL, 30, 28 },
+	{ 0xc097ce7bc90715b3ULL, 56, 36 },
+	{ 0x8f7e32ce7bea5c70ULL, 83, 44 },
+	{ 0xd5d238a4abe98068ULL, 109, 52 },
+	{ 0x9f4f2726179a2245ULL, 136, 60 },
+	{ 0xed63a231d4c4fb27ULL, 162, 68 },
+	{ 0xb0de65388cc8ada8ULL, 189, 76 },
+	{ 0x83c7088e1aab65dbULL, 216, 84 },
+	{ 0xc45d1df942711d9aULL, 242, 92 },
+	{ 0x924d692ca61be758ULL, 269, 100 },
+	{ 0xda01ee641a708deaULL, 295, 108 },
+	{ 0xa26da3999aef774aULL, 322, 116 },
+	{ 0xf209787bb47d6b85ULL, 348, 124 },
+	{ 0xb454e4a179dd1877ULL, 375, 132 },
+	{ 0x865b86925b9bc5c2ULL, 402, 140 },
+	{ 0xc83553c5c8965d3dULL, 428, 148 },
+	{ 0x952ab45cfa97a0b3ULL, 455, 156 },
+	{ 0xde469fbd99a05fe3ULL, 481, 164 },
+	{ 0xa59bc234db398c25ULL, 508, 172 },
+	{ 0xf6c69a72a3989f5cULL, 534, 180 },
+	{ 0xb7dcbf5354e9beceULL, 561, 188 },
+	{ 0x88fcf317f22241e2ULL, 588, 196 },
+	{ 0xcc20ce9bd35c78a5ULL, 614, 204 },
+	{ 0x98165af37b2153dfULL, 641, 212 },
+	{ 0xe2a0b5dc971f303aULL, 667, 220 },
+	{ 0xa8d9d1535ce3b396ULL, 694, 228 },
+	{ 0xfb9b7cd9a4a7443cULL, 720, 236 },
+	{ 0xbb764c4ca7a44410ULL, 747, 244 },
+	{ 0x8bab8eefb6409c1aULL, 774, 252 },
+	{ 0xd01fef10a657842cULL, 800, 260 },
+	{ 0x9b10a4e5e9913129ULL, 827, 268 },
+	{ 0xe7109bfba19c0c9dULL, 853, 276 },
+	{ 0xac2820d9623bf429ULL, 880, 284 },
+	{ 0x80444b5e7aa7cf85ULL, 907, 292 },
+	{ 0xbf21e44003acdd2dULL, 933, 300 },
+	{ 0x8e679c2f5e44ff8fULL, 960, 308 },
+	{ 0xd433179d9c8cb841ULL, 986, 316 },
+	{ 0x9e19db92b4e31ba9ULL, 1013, 324 },
+	{ 0xeb96bf6ebadf77d9ULL, 1039, 332 },
+	{ 0xaf87023b9bf0ee6bULL, 1066, 340 },
+};
+
+// trims the last digit towards w, false if the digits are not provably
+// the shortest closest ones
+bool grisu_round_weed(char* digits, int length, unsigned long long distance_high_w,
+	unsigned long long unsafe_interval, unsigned long long rest,
+	unsigned long long ten_kappa, unsigned long long unit) {
+	unsigned long long small_distance = distance_high_w - unit;
+	unsigned long long big_distance = distance_high_w + unit;
+	while (rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+		(rest + ten_kappa < small_distance ||
+			small_distance - rest >= rest + ten_kappa - small_distance)) {
+		--digits[length - 1];
+		rest += ten_kappa;
+	}
+	if (rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+		(rest + ten_kappa < big_distance ||
+			big_distance - rest > rest + ten_kappa - big_distance))
+		return false;
+	return (2 * unit <= rest) && (rest <= unsafe_interval - 4 * unit);
+}
+
+bool grisu_digit_gen(diy_fp low, diy_fp w, diy_fp high, char* digits,
+	int& length, int& kappa) {
+	unsigned long long unit = 1;
+	diy_fp too_low{ low.f - unit, low.e };
+	diy_fp too_high{ high.f + unit, high.e };
+	unsigned long long unsafe_interval = too_high.f - too_low.f;
+	int shift = -w.e;
+	unsigned long long one = 1ULL << shift;
+	unsigned integrals = (unsigned)(too_high.f >> shift);
+	unsigned long long fractionals = too_high.f & (one - 1);
+	unsigned divisor = 1;
+	kappa = 0;
+	if (integrals > 0) {
+		kappa = 1;
+		while (divisor <= integrals / 10) {
+			divisor *= 10;
+			++kappa;
+		}
+	}
+	length = 0;
+	while (kappa > 0) {
+		digits[length++] = (char)('0' + integrals / divisor);
+		integrals %= divisor;
+		--kappa;
+		unsigned long long rest = ((unsigned long long)integrals << shift) + fractionals;
+		if (rest < unsafe_interval)
+			return grisu_round_weed(digits, length, too_high.f - w.f, unsafe_interval,
+				rest, (unsigned long long)divisor << shift, unit);
+		divisor /= 10;
+	}
+	for (;;) {
+		fractionals *= 10;
+		unit *= 10;
+		unsafe_interval *= 10;
+		digits[length++] = (char)('0' + (fractionals >> shift));
+		fractionals &= one - 1;
+		--kappa;
+		if (fractionals < unsafe_interval)
+			return grisu_round_weed(digits, length, (too_high.f - w.f) * unit,
+				unsafe_interval, fractionals, one, unit);
+	}
+}
+
+// shortest digits of a positive finite v: v = digits * 10^exp10
+bool grisu3(double v, char* digits, int& length, int& exp10) {
+	unsigned long long bits{};
+	memcpy(&bits, &v, sizeof(v));
+	const unsigned long long hidden = 1ULL << 52;
+	int biased = (int)((bits >> 52) & 0x7ff);
+	unsigned long long fraction = bits & (hidden - 1);
+	diy_fp x;
+	if (biased == 0) {
+		x.f = fraction;
+		x.e = 1 - 1075;
+	}
+	else {
+		x.f = fraction | hidden;
+		x.e = biased - 1075;
+	}
+	diy_fp w = diy_normalize(x);
+	// boundaries halfway to the neighbours
+	diy_fp plus = diy_normalize(diy_fp{ (x.f << 1) + 1, x.e - 1 });
+	diy_fp minus;
+	if (fraction == 0 && biased > 1) minus = diy_fp{ (x.f << 2) - 1, x.e - 2 };
+	else minus = diy_fp{ (x.f << 1) - 1, x.e - 1 };
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+	// cached power bringing the exponent into [-60, -32]
+	int min_exponent = -60 - (w.e + 64);
+	int k = (int)ceil((min_exponent + 63) * 0.30102999566398114);
+	const cached_power& c = cached_powers[(348 + k - 1) / 8 + 1];
+	diy_fp ten_mk{ c.f, c.e };
+	int kappa{};
+	bool ok = grisu_digit_gen(diy_multiply(minus, ten_mk), diy_multiply(w, ten_mk),
+		diy_multiply(plus, ten_mk), digits, length, kappa);
+	exp10 = kappa - c.k;
+	return ok;
+}
+
+// slow path: shortest printf precision that reads back
+void exact_digits(double v, char* digits, int& length, int& exp10) {
+	char text[40];
+	for (int precision = 1; precision <= 17; ++precision) {
+		snprintf(text, sizeof(text), "%.*e", precision - 1, v);
+		if (strtod(text, nullptr) == v) break;
+	}
+	// d.ddde+xx
+	length = 0;
+	const char* p = text;
+	for (; *p != 'e'; ++p)
+		if (*p != '.') digits[length++] = *p;
+	int e = atoi(p + 1);
+	while (length > 1 && digits[length - 1] == '0') --length;
+	exp10 = e - (length - 1);
+}
+
+// writes the shortest round trip text of v, returns its length (< 32)
+size_t format_shortest(double v, char* out) {
+	char* p = out;
+	if (v != v) {
+		memcpy(p, "nan", 3);
+		return 3;
+	}
+	if (signbit(v)) {
+		*p++ = '-';
+		v = -v;
+	}
+	if (v == 0) {
+		*p++ = '0';
+		return p - out;
+	}
+	if (isinf(v)) {
+		memcpy(p, "inf", 3);
+		return p + 3 - out;
+	}
+	char digits[24];
+	int length{}, exp10{};
+	if (not grisu3(v, digits, length, exp10)) exact_digits(v, digits, length, exp10);
+	// position of the decimal point after the first `point` digits
+	int point = length + exp10;
+	if (point > 0 && point <= 21) {
+		if (point >= length) {
+			// integer
+			memcpy(p, digits, length);
+			p += length;
+			for (int i = length; i < point; ++i) *p++ = '0';
+		}
+		else {
+			memcpy(p, digits, point);
+			p += point;
+			*p++ = '.';
+			memcpy(p, digits + point, length - point);
+			p += length - point;
+		}
+	}
+	else if (point <= 0 && point > -6) {
+		*p++ = '0';
+		*p++ = '.';
+		for (int i = point; i < 0; ++i) *p++ = '0';
+		memcpy(p, digits, length);
+		p += length;
+	}
+	else {
+		// d.ddde+x
+		*p++ = digits[0];
+		if (length > 1) {
+			*p++ = '.';
+			memcpy(p, digits + 1, length - 1);
+			p += length - 1;
+		}
+		int e = point - 1;
+		*p++ = 'e';
+		*p++ = e < 0 ? '-' : '+';
+		if (e < 0) e = -e;
+		if (e >= 100) *p++ = (char)('0' + e / 100);
+		if (e >= 10) *p++ = (char)('0' + e / 10 % 10);
+		*p++ = (char)('0' + e % 10);
+	}
+	return p - out;
+}
+
+// precision 0 is the shortest round trip text, otherwise printf %.*g,
+// returns the length (< 32)
+size_t format_double(double v, int precision, char* out) {
+	if (precision <= 0) return format_shortest(v, out);
+	int n = snprintf(out, 32, "%.*g", precision > 17 ? 17 : precision, v);
+	return (size_t)n;
+}
+
+// returns the length (< 24)
+size_t format_integer(long long v, char* out) {
+	char digits[24];
+	int n = 0;
+	// negate as unsigned, LLONG_MIN has no positive counterpart
+	unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+	do {
+		digits[n++] = (char)('0' + u % 10);
+		u /= 10;
+	} while (u != 0);
+	char* p = out;
+	if (v < 0) *p++ = '-';
+	while (n > 0) *p++ = digits[--n];
+	return p - out;
+}
+
+// prints opcode pair statistics of the expressions read from stdin
+void print_opcode_stats() {
+	compile_options opt;
+	opt.fuse = false;
+	opcode_stats stats;
+	string line;
+	while (getline(cin, line)) {
+		string_strip(line);
+		if (line.empty()) continue;
+		tokenizer tk(line);
+		tk.parse();
+		if (tk.error_state()) continue;
+		eval ev(tk, opt);
+		ev.compile();
+		if (ev.error_state()) continue;
+		stats.add(ev.get_program());
+	}
+	stats.print(cout);
+}
+
+// command line options
+class cli_options {
+public:
+	bool opstats{};
+	bool batch{};
+	bool interactive{};
+	// batch worker threads, 0 means one per hardware thread
+	size_t threads{};
+	// staged read / parse / evaluate / write threads
+	bool pipeline{};
+	bool pipeline_stats{};
+	// batch lines in order, "name = expression" defines a cell
+	bool cells{};
+	// evaluate every distinct line of a window of batch input once
+	bool dedup{};
+	// memory for subexpression results shared by a --dedup window,
+	// 0 disables sharing
+	size_t share_bytes{};
+	// significant digits of results, 0 is the shortest round trip text
+	int precision{};
+	// raw little endian doubles instead of text
+	bool binary{};
+	// --pairwise and other compiler settings
+	compile_options compile{};
+	// memory of the program cache, 0 disables it
+	size_t cache_bytes{ 32 << 20 };
+	bool cache_stats{};
+	// programs kept between runs
+	string cache_file{};
+	// remembered results of repeated lines per worker, 0 disables it
+	size_t result_slots{ 4096 };
+	// evaluate expr over the rows of a CSV file
+	string csv_path{};
+	string expr{};
+	char delimiter{ ',' };
+};
+
+// returns false on an unknown option
+bool parse_cli(int argc, char* argv[], cli_options& opt) {
+	for (int i = 1; i < argc; ++i) {
+		string arg{ argv[i] };
+		if (arg == "--opstats") opt.opstats = true;
+		else if (arg == "--batch") opt.batch = true;
+		else if (arg == "--interactive") opt.interactive = true;
+		else if (arg == "--pipeline") opt.pipeline = true;
+		else if (arg == "--cells") opt.cells = true;
+		else if (arg == "--dedup") opt.dedup = true;
+		else if (arg == "--share" && i + 1 < argc) {
+			opt.share_bytes = strtoul(argv[++i], nullptr, 10) << 20;
+			opt.dedup = true;
+		}
+		else if (arg == "--pairwise") opt.compile.pairwise_terms = 32;
+		else if (arg == "--canonical") opt.compile.canonical = true;
+		else if (arg == "--canonical-chains") opt.compile.canonical_chains = true;
+		else if (arg == "--cache-size" && i + 1 < argc)
+			opt.cache_bytes = strtoul(argv[++i], nullptr, 10) << 20;
+		else if (arg == "--cache-stats") opt.cache_stats = true;
+		else if (arg == "--cache-file" && i + 1 < argc) opt.cache_file = argv[++i];
+		else if (arg == "--result-cache" && i + 1 < argc)
+			opt.result_slots = strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--csv" && i + 1 < argc) opt.csv_path = argv[++i];
+		else if (arg == "--tsv" && i + 1 < argc) {
+			opt.csv_path = argv[++i];
+			opt.delimiter = '\t';
+		}
+		else if (arg == "--expr" && i + 1 < argc) opt.expr = argv[++i];
+		else if (arg == "--precision" && i + 1 < argc) opt.precision = atoi(argv[++i]);
+		else if (arg == "--output" && i + 1 < argc && string(argv[i + 1]) == "text") ++i;
+		else if (arg == "--output" && i + 1 < argc && string(argv[i + 1]) == "binary") {
+			opt.binary = opt.batch = true;
+			++i;
+		}
+		else if (arg == "--pipeline-stats") opt.pipeline = opt.pipeline_stats = true;
+		else if (arg == "--threads" && i + 1 < argc) opt.threads = strtoul(argv[++i], nullptr, 10);
+		else {
+			cerr << "unknown option: " << arg << "\n";
+			return false;
+		}
+	}
+	if (opt.csv_path.empty() != opt.expr.empty()) {
+		cerr << "--csv and --tsv need --expr\n";
+		return false;
+	}
+	return true;
+}
+
+void print_usage() {
+	cerr << "usage: simple_eval [--batch | --interactive]\n"
+		<< "                   [--threads N | --pipeline | --cells]\n"
+		<< "                   [--dedup] [--share MB]\n"
+		<< "                   [--pipeline-stats] [--precision N] [--output text|binary]\n"
+		<< "                   [--pairwise] [--canonical | --canonical-chains]\n"
+		<< "                   [--cache-size MB] [--cache-stats] [--cache-file PATH]\n"
+		<< "                   [--result-cache N] [--opstats]\n"
+		<< "       simple_eval --csv FILE | --tsv FILE --expr EXPR [--precision N]\n"
+		<< "                   [--output text|binary]\n"
+		<< "  --batch        read expressions from stdin, one result per line\n"
+		<< "                 (default when stdin is not a terminal)\n"
+		<< "  --interactive  prompt for expressions even if stdin is redirected\n"
+		<< "  --threads N    batch worker threads (default: one per CPU)\n"
+		<< "  --pipeline     batch on a read / parse / evaluate / write pipeline\n"
+		<< "  --pipeline-stats\n"
+		<< "                 like --pipeline, prints stage occupancy to stderr\n"
+		<< "  --dedup        evaluate repeated batch lines once, with --threads\n"
+		<< "  --share MB     with --dedup, compute bracketed subexpressions that\n"
+		<< "                 lines share once, in MB of memory\n"
+		<< "  --cells        batch lines in order, name = expr defines a cell that\n"
+		<< "                 later lines read by name\n"
+		<< "  --precision N  print results with N significant digits, integers too\n"
+		<< "                 (default: shortest text that reads back exactly)\n"
+		<< "  --output binary\n"
+		<< "                 batch results as a little endian double stream\n"
+		<< "  --pairwise     sum and multiply long chains pairwise (more accurate,\n"
+		<< "                 parallel, rounded differently than left to right)\n"
+		<< "  --canonical    compile a+b and b+a to one cached program (exact)\n"
+		<< "  --canonical-chains\n"
+		<< "                 also sort the terms of + and * chains (may change\n"
+		<< "                 rounding)\n"
+		<< "  --cache-size MB\n"
+		<< "                 memory for compiled programs of repeated lines\n"
+		<< "                 (default: 32, 0 disables the cache)\n"
+		<< "  --cache-stats  print cache hits, misses and evictions to stderr\n"
+		<< "  --result-cache N\n"
+		<< "                 results of repeated lines kept per worker\n"
+		<< "                 (default: 4096, 0 disables it)\n"
+		<< "  --cache-file PATH\n"
+		<< "                 compact file of compiled programs: decode them from\n"
+		<< "                 PATH instead of compiling, save new ones\n"
+		<< "  --csv FILE     evaluate --expr for every row, header names are variables\n"
+		<< "  --tsv FILE     like --csv for tab separated files\n"
+		<< "  --opstats      print opcode pair statistics of stdin expressions\n";
+}
+
+bool stdin_is_terminal() {
+#ifdef _WIN32
+	return _isatty(_fileno(stdin)) != 0;
+#else
+	return isatty(fileno(stdin)) != 0;
+#endif
+}
+
+/*  ~ Batch mode ~
+
+	Expressions are read from stdin and one line is written per input
+	line, without banner or prompts. Both sides bypass iostreams: input
+	is read with fread() in large blocks and results are collected in a
+	large output buffer that is written with fwrite() only when full, so
+	a million lines cost a handful of syscalls instead of one flush per
+	line. Blank input lines give blank output lines to keep the line
+	numbers of input and output aligned. */
+
+// large write buffer over a FILE
+class output_buffer {
+private:
+	FILE* file;
+	vector<char> buffer;
+	size_t used;
+public:
+	output_buffer(FILE* f, size_t size = 1 << 20);
+	~output_buffer();
+	void write(const char* data, size_t n);
+	void put(char c);
+	// room for n bytes to write in place, then commit() what was used
+	char* reserve(size_t n);
+	void commit(size_t n);
+	void flush();
+};
+
+output_buffer::output_buffer(FILE* f, size_t size)
+	: file{ f }, buffer(size), used{} {}
+
+output_buffer::~output_buffer() { flush(); }
+
+void output_buffer::write(const char* data, size_t n) {
+	if (used + n > buffer.size()) {
+		flush();
+		if (n > buffer.size()) {
+			fwrite(data, 1, n, file);
+			return;
+		}
+	}
+	memcpy(buffer.data() + used, data, n);
+	used += n;
+}
+
+void output_buffer::put(char c) {
+	if (used == buffer.size()) flush();
+	buffer[used++] = c;
+}
+
+char* output_buffer::reserve(size_t n) {
+	if (used + n > buffer.size()) flush();
+	if (n > buffer.size()) buffer.resize(n);
+	return buffer.data() + used;
+}
+
+void output_buffer::commit(size_t n) { used += n; }
+
+void output_buffer::flush() {
+	if (used > 0) fwrite(buffer.data(), 1, used, file);
+	used = 0;
+	fflush(file);
+}
+
+// reads lines from a FILE in large blocks
+class line_reader {
+private:
+	FILE* file;
+	vector<char> buffer;
+	size_t begin;
+	size_t end;
+	bool eof;
+	bool fill();
+public:
+	line_reader(FILE* f, size_t size = 1 << 20);
+	// line without the end of line, false at the end of input
+	bool next(string& line);
+};
+
+line_reader::line_reader(FILE* f, size_t size)
+	: file{ f }, buffer(size), begin{}, end{}, eof{} {}
+
+bool line_reader::fill() {
+	if (eof) return false;
+	// keep the unread rest at the front
+	if (begin > 0) {
+		memmove(buffer.data(), buffer.data() + begin, end - begin);
+		end -= begin;
+		begin = 0;
+	}
+	if (end == buffer.size()) buffer.resize(buffer.size() * 2);
+	size_t n = fread(buffer.data() + end, 1, buffer.size() - end, file);
+	if (n == 0) eof = true;
+	end += n;
+	return n > 0;
+}
+
+bool line_reader::next(string& line) {
+	size_t scanned = begin;
+	for (;;) {
+		const char* data = buffer.data();
+		const void* nl = memchr(data + scanned, '\n', end - scanned);
+		if (nl != nullptr) {
+			size_t pos = (const char*)nl - data;
+			line.assign(data + begin, pos - begin);
+			begin = pos + 1;
+			return true;
+		}
+		scanned = end - begin;
+		if (not fill()) break;
+	}
+	// last line without end of line
+	if (begin == end) return false;
+	line.assign(buffer.data() + begin, end - begin);
+	begin = end;
+	return true;
+}
+
+// outcome of one input line
+enum class line_status {
+	ok,
+	blank,
+	parse_error,
+	error
+};
+
+class line_result {
+public:
+	line_status status{};
+	bool integer{};
+	double value{};
+	long long integer_value{};
+};
+
+// evaluates a compiled program like eval::solve() does,
+// values[] holds one value per slot of a program with variables
+line_result run_program(const program& p, const literal_values* literals = nullptr,
+	const double* values = nullptr) {
+	line_result r;
+	if (not p.slots.empty() && values == nullptr) {
+		// unbound variables
+		r.status = line_status::error;
+		return r;
+	}
+	r.status = line_status::ok;
+	if (not p.forks.empty()) {
+		thread_pool& pool = shared_pool();
+		r.integer = p.integer && p.run_integer_parallel(pool, r.integer_value, values, literals);
+		if (r.integer) r.value = (double)r.integer_value;
+		else r.value = p.run_parallel(pool, values, literals);
+		return r;
+	}
+	r.integer = p.integer && p.run_integer(r.integer_value, values, literals);
+	if (r.integer) r.value = (double)r.integer_value;
+	else r.value = p.run(values, literals);
+	return r;
+}
+
+/*  ~ Result cache ~
+
+	Without variables the result of a line depends only on its text, so
+	a repeated line needs neither tokenizing nor running. Every worker
+	keeps the results (and errors) of recent lines in a direct mapped
+	table keyed by the normalized text: a lookup is one pass to
+	normalize, a hash of eight bytes per step and one compare, no lock
+	and no allocation once the keys are in place. A colliding line
+	replaces the older one. Lines longer than max_key are not kept, the
+	program cache still spares them the compile. */
+
+class result_cache {
+private:
+	class entry {
+	public:
+		unsigned long long hash{};
+		string key{};
+		line_result result{};
+	};
+	// power of two entries, an empty key is an unused entry
+	vector<entry> entries;
+	size_t hits;
+public:
+	static const size_t max_key = 256;
+	result_cache(size_t slots = 0);
+	bool enabled() const;
+	static unsigned long long hash(const string& key);
+	bool find(const string& key, unsigned long long h, line_result& out);
+	void insert(const string& key, unsigned long long h, const line_result& r);
+	// hits since the last call
+	size_t take_hits();
+};
+
+result_cache::result_cache(size_t slots) : entries{}, hits{} {
+	size_t n = 1;
+	while (n < slots) n *= 2;
+	if (slots > 0) entries.resize(n);
+}
+
+bool result_cache::enabled() const { return not entries.empty(); }
+
+unsigned long long result_cache::hash(const string& key) {
+	const char* p = key.data();
+	size_t n = key.size();
+	unsigned long long h = n * 0x9e3779b97f4a7c15ULL;
+	for (; n >= 8; n -= 8, p += 8) {
+		unsigned long long w{};
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	if (n > 0) {
+		unsigned long long w{};
+		memcpy(&w, p, n);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+	}
+	return mix_hash(h);
+}
+
+bool result_cache::find(const string& key, unsigned long long h, line_result& out) {
+	const entry& e = entries[h & (entries.size() - 1)];
+	if (e.hash != h || e.key != key) return false;
+	++hits;
+	out = e.result;
+	return true;
+}
+
+void result_cache::insert(const string& key, unsigned long long h, const line_result& r) {
+	if (key.empty() || key.size() > max_key) return;
+	entry& e = entries[h & (entries.size() - 1)];
+	e.hash = h;
+	e.key = key;
+	e.result = r;
+}
+
+size_t result_cache::take_hits() {
+	size_t n = hits;
+	hits = 0;
+	return n;
+}
+
+// reusable tokenizer and evaluator state of one batch worker
+class line_evaluator {
+private:
+	tokenizer tk;
+	eval ev;
+	// compiled programs shared with other workers, may be null
+	program_cache* cache;
+	string key;
+	prepared_expression expr;
+	// shape of the canonical postfix tokens
+	bool canonical;
+	expression_shape canonical_shape;
+	result_cache results;
+	// compiles a stripped line, key holds its normalized text
+	line_status compile(string& line, prepared_expression& out);
+	// evaluates a stripped, non-blank line
+	line_result solve(string& line);
+public:
+	line_evaluator(const compile_options& opt = {}, program_cache* c = nullptr,
+		size_t result_slots = 0);
+	~line_evaluator();
+	// compiles the line, through the cache if there is one
+	line_status prepare(string& line, prepared_expression& out);
+	line_result evaluate(string& line);
+	// adds the result cache hits to the statistics of the program cache
+	void flush_stats();
+};
+
+line_evaluator::line_evaluator(const compile_options& opt, program_cache* c,
+	size_t result_slots)
+	: tk{ string{} }, ev{ token_list{}, c != nullptr ? shape_options(opt) : opt },
+	cache{ c }, key{}, expr{},
+	canonical{ opt.canonical || opt.canonical_chains }, canonical_shape{},
+	results{ result_slots } {}
+
+line_evaluator::~line_evaluator() { flush_stats(); }
+
+void line_evaluator::flush_stats() {
+	size_t hits = results.take_hits();
+	if (cache != nullptr && hits > 0) cache->count_results(hits);
+}
+
+line_status line_evaluator::prepare(string& line, prepared_expression& out) {
+	string_strip(line);
+	if (line.empty()) return line_status::blank;
+	if (cache != nullptr) program_cache::normalize(line, key);
+	return compile(line, out);
+}
+
+line_status line_evaluator::compile(string& line, prepared_expression& out) {
+	if (cache != nullptr && cache->find(key, out)) return line_status::ok;
+	tk.reset(line);
+	tk.parse();
+	if (tk.error_state()) return line_status::parse_error;
+	ev.reset(tk.tokens_ref());
+	const expression_shape* shape = &tk.get_shape();
+	if (canonical) {
+		// literals are numbered in canonical order
+		ev.postfix();
+		if (ev.error_state()) return line_status::error;
+		canonical_shape.clear();
+		for (const token& t : ev.tokens_ref()) canonical_shape.add(t);
+		shape = &canonical_shape;
+	}
+	out.literals = shape->literals;
+	out.prog = cache != nullptr ? cache->find_shape(*shape) : nullptr;
+	if (not out.prog) {
+		ev.compile();
+		if (ev.error_state()) return line_status::error;
+		out.prog = make_shared<program>(ev.get_program());
+	}
+	if (cache != nullptr) cache->insert(key, *shape, out.prog);
+	return line_status::ok;
+}
+
+bool program_cache::get(const string& text, prepared_expression& out) {
+	line_evaluator state(options, this);
+	string line{ text };
+	return state.prepare(line, out) == line_status::ok;
+}
+
+line_result line_evaluator::evaluate(string& line) {
+	line_result r;
+	string_strip(line);
+	if (line.empty()) {
+		r.status = line_status::blank;
+		return r;
+	}
+	if (results.enabled() || cache != nullptr) program_cache::normalize(line, key);
+	if (not results.enabled()) return solve(line);
+	unsigned long long h = result_cache::hash(key);
+	if (results.find(key, h, r)) return r;
+	r = solve(line);
+	results.insert(key, h, r);
+	return r;
+}
+
+line_result line_evaluator::solve(string& line) {
+	line_result r;
+	if (cache != nullptr) {
+		r.status = compile(line, expr);
+		if (r.status != line_status::ok) return r;
+		return run_program(*expr.prog, &expr.literals);
+	}
+	tk.reset(line);
+	tk.parse();
+	if (tk.error_state()) {
+		r.status = line_status::parse_error;
+		return r;
+	}
+	ev.reset(tk.tokens_ref());
+	ev.solve();
+	if (ev.error_state()) {
+		r.status = line_status::error;
+		return r;
+	}
+	r.status = line_status::ok;
+	r.integer = ev.is_integer();
+	r.value = ev.get_result();
+	r.integer_value = ev.get_integer_result();
+	return r;
+}
+
+/*  ~ Cells ~
+
+	"name = expression" defines a named cell, like a spreadsheet formula.
+	Variables of the expression read other cells, so the cells form a
+	dependency graph: every cell knows the cells it reads (inputs, by
+	program slot) and the cells that read it (readers). Defining a cell
+	marks it and everything downstream dirty and computes nothing.
+	Reading a cell recomputes the dirty cells of its upstream cone,
+	inputs first, so a change costs the cells that depend on it and are
+	read, not the whole model. A cell that reads an undefined cell or an
+	error is an error. Values pass between cells as doubles.
+
+	A recalculation first collects the dirty cone and levels it
+	topologically (Kahn): a level holds the cells whose inputs are all
+	in earlier levels, so its cells are independent and big levels run
+	on the thread pool. Cells left over when no level can be formed are
+	on or behind a cycle. All levels are formed before the first one is
+	computed, so the left over cells become errors and the cells on the
+	cycles are reported by cycles() before any result changes. */
+
+class cell {
+public:
+	string name{};
+	bool defined{};
+	program prog{};
+	// cells read by the formula, one per program slot
+	vector<size_t> inputs{};
+	// cells whose formulas read this one
+	vector<size_t> readers{};
+	bool dirty{ true };
+	// in the dirty cone of the running recalculation
+	bool visiting{};
+	// inputs (or readers) of the cone not yet done
+	size_t pending{};
+	line_result result{};
+};
+
+class cell_sheet {
+private:
+	vector<cell> cells;
+	unordered_map<string, size_t> index;
+	compile_options options;
+	size_t computed;
+	// names of the cells on cycles found by the last reads
+	vector<string> cycle_names;
+	// levels of at least this many cells are computed in parallel
+	static const size_t parallel_cells = 256;
+	// cell of a name, an undefined one when it is new
+	size_t cell_of(const string& name);
+	// marks c and everything that reads it dirty
+	void mark_dirty(size_t c);
+	// computes one cell from the results of its inputs
+	void compute(size_t c);
+	void compute_level(const vector<size_t>& level);
+	// turns the cells left in the cone (still visiting) into errors,
+	// names the cycles
+	void report_cycles(const vector<size_t>& cone);
+	// computes the dirty cells the roots depend on, then the roots
+	void recompute(const vector<size_t>& roots);
+public:
+	cell_sheet(const compile_options& opt = {});
+	// splits "name = expression", false for other lines
+	static bool split_definition(const string& line, string& name, string& formula);
+	// sets the formula of a cell, a formula with errors changes nothing
+	line_status define(const string& name, const string& formula);
+	// value of a cell, recomputed if it is dirty
+	line_result get(const string& name);
+	// values of cells, recomputed together
+	vector<line_result> get(const vector<string>& names);
+	// a cell of the name exists: defined, or read by a formula
+	bool has(const string& name) const;
+	// evaluates an expression that reads cells
+	line_result evaluate(const string& expr);
+	bool empty() const;
+	// cells computed so far
+	size_t computed_cells() const;
+	// cells on dependency cycles found by the last get() or evaluate()
+	const vector<string>& cycles() const;
+};
+
+cell_sheet::cell_sheet(const compile_options& opt)
+	: cells{}, index{}, options{ opt }, computed{}, cycle_names{} {
+	// a formula runs many times with its own literals
+	options.fold_constants = true;
+}
+
+bool cell_sheet::split_definition(const string& line, string& name, string& formula) {
+	size_t eq = line.find('=');
+	if (eq == string::npos) return false;
+	name = line.substr(0, eq);
+	formula = line.substr(eq + 1);
+	string_strip(name);
+	if (name.empty() || not (isalpha((unsigned char)name[0]) || name[0] == '_')) return false;
+	for (char c : name)
+		if (not (isalnum((unsigned char)c) || c == '_')) return false;
+	return true;
+}
+
+size_t cell_sheet::cell_of(const string& name) {
+	auto it = index.find(name);
+	if (it != index.end()) return it->second;
+	cell c;
+	c.name = name;
+	cells.push_back(move(c));
+	index.emplace(name, cells.size() - 1);
+	return cells.size() - 1;
+}
+
+line_status cell_sheet::define(const string& name, const string& formula) {
+	tokenizer tk(formula);
+	tk.parse();
+	if (tk.error_state()) return line_status::parse_error;
+	eval ev(tk, options);
+	ev.compile();
+	if (ev.error_state()) return line_status::error;
+	size_t c = cell_of(name);
+	for (size_t i : cells[c].inputs) {
+		vector<size_t>& r = cells[i].readers;
+		r.erase(find(r.begin(), r.end(), c));
+	}
+	cells[c].prog = ev.get_program();
+	cells[c].defined = true;
+	vector<size_t> inputs;
+	for (const string& s : cells[c].prog.slots) inputs.push_back(cell_of(s));
+	for (size_t i : inputs) cells[i].readers.push_back(c);
+	cells[c].inputs = move(inputs);
+	mark_dirty(c);
+	return line_status::ok;
+}
+
+void cell_sheet::mark_dirty(size_t c) {
+	// cells downstream of a dirty cell are dirty already
+	vector<size_t> todo{ c };
+	cells[c].dirty = true;
+	while (not todo.empty()) {
+		size_t i = todo.back();
+		todo.pop_back();
+		for (size_t r : cells[i].readers) {
+			if (cells[r].dirty) continue;
+			cells[r].dirty = true;
+			todo.push_back(r);
+		}
+	}
+}
+
+void cell_sheet::compute(size_t c) {
+	cell& x = cells[c];
+	x.result = {};
+	x.result.status = line_status::error;
+	if (not x.defined) return;
+	vector<double> values(x.inputs.size());
+	for (size_t s = 0; s < x.inputs.size(); ++s) {
+		const cell& in = cells[x.inputs[s]];
+		if (in.dirty || in.result.status != line_status::ok) return;
+		values[s] = in.result.value;
+	}
+	x.result = run_program(x.prog, nullptr, values.data());
+}
+
+void cell_sheet::compute_level(const vector<size_t>& level) {
+	computed += level.size();
+	if (level.size() < parallel_cells) {
+		for (size_t c : level) compute(c);
+		return;
+	}
+	// cells of a level only read earlier levels
+	thread_pool& pool = shared_pool();
+	size_t step = max(level.size() / (4 * pool.size()), parallel_cells / 4);
+	task_group group(pool);
+	for (size_t b = 0; b < level.size(); b += step) {
+		size_t e = min(b + step, level.size());
+		group.run([this, &level, b, e] {
+			for (size_t i = b; i < e; ++i) compute(level[i]);
+		});
+	}
+	group.wait();
+}
+
+void cell_sheet::recompute(const vector<size_t>& roots) {
+	// the dirty cone: the dirty roots and their dirty inputs, transitively
+	vector<size_t> cone;
+	for (size_t c : roots) {
+		if (not cells[c].dirty || cells[c].visiting) continue;
+		cells[c].visiting = true;
+		cone.push_back(c);
+	}
+	if (cone.empty()) return;
+	for (size_t k = 0; k < cone.size(); ++k)
+		for (size_t in : cells[cone[k]].inputs) {
+			if (not cells[in].dirty || cells[in].visiting) continue;
+			cells[in].visiting = true;
+			cone.push_back(in);
+		}
+	vector<size_t> level, next;
+	for (size_t x : cone) {
+		cells[x].pending = 0;
+		for (size_t in : cells[x].inputs)
+			if (cells[in].visiting) ++cells[x].pending;
+		if (cells[x].pending == 0) level.push_back(x);
+	}
+	// levels in topological order, cycles never reach pending 0;
+	// a cell leaves the visiting cells when it gets its level
+	vector<vector<size_t>> levels;
+	size_t done = 0;
+	while (not level.empty()) {
+		done += level.size();
+		next.clear();
+		for (size_t x : level) {
+			cells[x].visiting = false;
+			for (size_t r : cells[x].readers)
+				if (cells[r].visiting && --cells[r].pending == 0)
+					next.push_back(r);
+		}
+		levels.emplace_back();
+		levels.back().swap(level);
+		swap(level, next);
+	}
+	if (done < cone.size()) report_cycles(cone);
+	for (const vector<size_t>& l : levels) {
+		compute_level(l);
+		for (size_t x : l) cells[x].dirty = false;
+	}
+	for (size_t x : cone) cells[x].visiting = false;
+}
+
+void cell_sheet::report_cycles(const vector<size_t>& cone) {
+	// trim the cells that feed no other left over cell, the rest are
+	// cycles (and rarely cells between two cycles)
+	vector<size_t> left, trim;
+	for (size_t x : cone) {
+		if (not cells[x].visiting) continue;
+		cells[x].result = {};
+		cells[x].result.status = line_status::error;
+		left.push_back(x);
+	}
+	for (size_t x : left) {
+		cells[x].pending = 0;
+		for (size_t r : cells[x].readers)
+			if (cells[r].visiting && cells[r].dirty) ++cells[x].pending;
+		if (cells[x].pending == 0) trim.push_back(x);
+	}
+	while (not trim.empty()) {
+		size_t x = trim.back();
+		trim.pop_back();
+		cells[x].dirty = false;
+		for (size_t in : cells[x].inputs)
+			if (cells[in].visiting && cells[in].dirty && --cells[in].pending == 0)
+				trim.push_back(in);
+	}
+	for (size_t x : left) {
+		if (cells[x].dirty) cycle_names.push_back(cells[x].name);
+		cells[x].dirty = false;
+	}
+}
+
+line_result cell_sheet::get(const string& name) {
+	cycle_names.clear();
+	auto it = index.find(name);
+	if (it == index.end()) {
+		line_result r;
+		r.status = line_status::error;
+		return r;
+	}
+	recompute({ it->second });
+	return cells[it->second].result;
+}
+
+vector<line_result> cell_sheet::get(const vector<string>& names) {
+	cycle_names.clear();
+	vector<size_t> roots;
+	for (const string& name : names) {
+		auto it = index.find(name);
+		if (it != index.end()) roots.push_back(it->second);
+	}
+	recompute(roots);
+	vector<line_result> results(names.size());
+	for (size_t i = 0; i < names.size(); ++i) {
+		auto it = index.find(names[i]);
+		if (it != index.end()) results[i] = cells[it->second].result;
+		else results[i].status = line_status::error;
+	}
+	return results;
+}
+
+line_result cell_sheet::evaluate(const string& expr) {
+	line_result r;
+	tokenizer tk(expr);
+	tk.parse();
+	if (tk.error_state()) {
+		r.status = line_status::parse_error;
+		return r;
+	}
+	eval ev(tk, options);
+	ev.compile();
+	r.status = line_status::error;
+	if (ev.error_state()) return r;
+	const program& p = ev.get_program();
+	vector<double> values(p.slots.size());
+	cycle_names.clear();
+	vector<size_t> roots;
+	for (const string& s : p.slots) {
+		auto it = index.find(s);
+		if (it != index.end()) roots.push_back(it->second);
+	}
+	recompute(roots);
+	for (size_t s = 0; s < p.slots.size(); ++s) {
+		auto it = index.find(p.slots[s]);
+		if (it == index.end() || cells[it->second].result.status != line_status::ok) return r;
+		values[s] = cells[it->second].result.value;
+	}
+	return run_program(p, nullptr, values.data());
+}
+
+bool cell_sheet::empty() const { return cells.empty(); }
+bool cell_sheet::has(const string& name) const { return index.count(name) != 0; }
+size_t cell_sheet::computed_cells() const { return computed; }
+const vector<string>& cell_sheet::cycles() const { return cycle_names; }
+
+// a definition gives the value of its cell, expressions with
+// variables read the cells
+line_result evaluate_cell_line(cell_sheet& sheet, line_evaluator& state, string& line) {
+	string name, formula;
+	if (cell_sheet::split_definition(line, name, formula)) {
+		line_result r;
+		r.status = sheet.define(name, formula);
+		if (r.status != line_status::ok) return r;
+		return sheet.get(name);
+	}
+	line_result r = state.evaluate(line);
+	if (r.status == line_status::error && not sheet.empty()) r = sheet.evaluate(line);
+	return r;
+}
+
+/*  ~ Line edits ~
+
+	REPL users edit long expressions a number or an operator at a time.
+	line_edit keeps the tokens of the last line with their text offsets
+	and the expression tree with the value of every node. A new line is
+	compared with the last one: the common prefix and suffix are kept
+	and only the tokens around the changed span are lexed again, one
+	unchanged token of context on each side so that tokens merging
+	across the edit are caught. When the edit only changed literals or
+	swapped operators of one precedence (+ -, * /), the tree keeps its
+	shape and only the ancestors of the changed nodes are recomputed;
+	other edits rebuild the tree from the spliced tokens. The tree
+	computes the operations of program::run() and run_integer() in the
+	same order, so results are those of a full evaluation. Lines with
+	variables, and pairwise or sorted chains, take the full path. */
+
+// value of a subtree in both arithmetics of the interpreter
+class exact_value {
+public:
+	double value{};
+	long long integer_value{};
+	// exact in 64-bit integers, no division or overflow below
+	bool integer{};
+};
+
+exact_value literal_value(const token& t, const compile_options& opt) {
+	exact_value v;
+	v.value = t.number;
+	v.integer = opt.integer && integer_literal(t.text, v.integer_value);
+	return v;
+}
+
+exact_value apply_operator(token_type op, const exact_value& a, const exact_value& b) {
+	exact_value x;
+	x.integer = a.integer && b.integer;
+	switch (op) {
+		case token_type::op_add:
+			x.value = a.value + b.value;
+			if (x.integer) x.integer = checked_add(a.integer_value, b.integer_value, x.integer_value);
+			break;
+		case token_type::op_sub:
+			x.value = a.value - b.value;
+			if (x.integer) x.integer = checked_sub(a.integer_value, b.integer_value, x.integer_value);
+			break;
+		case token_type::op_mul:
+			x.value = a.value * b.value;
+			if (x.integer) x.integer = checked_mul(a.integer_value, b.integer_value, x.integer_value);
+			break;
+		default:
+			x.value = a.value / b.value;
+			x.integer = false;
+			break;
+	}
+	return x;
+}
+
+// result of a whole expression, like run_program()
+line_result exact_result(const exact_value& v) {
+	line_result r;
+	r.status = line_status::ok;
+	r.integer = v.integer;
+	r.integer_value = v.integer_value;
+	r.value = v.integer ? (double)v.integer_value : v.value;
+	return r;
+}
+
+class line_edit {
+private:
+	class node {
+	public:
+		token_type op{};
+		// children, postfix positions, leaves have none
+		size_t left{};
+		size_t right{};
+		size_t parent{};
+		exact_value value{};
+	};
+	compile_options options;
+	// tokens and tree are those of text
+	bool valid;
+	string text;
+	token_list tokens;
+	// [begin, end) of every token in text
+	vector<pair<size_t, size_t>> spans;
+	// postfix order of the tree, node of every token (brackets: none)
+	vector<node> nodes;
+	vector<size_t> node_of;
+	size_t relexed;
+	size_t recomputed;
+	// offsets of tokens lexed from text[begin, end), false on errors
+	static bool lex(const string& text, size_t begin, size_t end, token_list& out,
+		vector<pair<size_t, size_t>>& out_spans);
+	// the tree of the tokens, false for lines with variables
+	bool build();
+	void compute(size_t n);
+	// lexes what line changed, false on errors; edited lists the
+	// changed tokens while the tree keeps its shape, otherwise the
+	// tree is no longer valid
+	bool splice(const string& line, vector<size_t>& edited);
+public:
+	line_edit(const compile_options& opt = {});
+	// evaluates line reusing what the last line left, false when the
+	// line has errors or needs the full path
+	bool evaluate(const string& line, line_result& r);
+	// characters lexed and nodes computed by the last evaluate()
+	size_t relexed_chars() const;
+	size_t recomputed_nodes() const;
+};
+
+line_edit::line_edit(const compile_options& opt)
+	: options{ opt }, valid{}, text{}, tokens{}, spans{}, nodes{}, node_of{},
+	relexed{}, recomputed{} {}
+
+bool line_edit::lex(const string& text, size_t begin, size_t end, token_list& out,
+	vector<pair<size_t, size_t>>& out_spans) {
+	tokenizer tk(text.substr(begin, end - begin));
+	tk.lex();
+	if (tk.error_state()) return false;
+	out = tk.get_tokens();
+	out_spans.clear();
+	// a token is its non-blank characters, numbers may hold blanks
+	size_t pos = begin;
+	for (const token& t : out) {
+		while (isspace((unsigned char)text[pos])) ++pos;
+		size_t first = pos;
+		for (size_t k = 0; k < t.text.size(); ++k) {
+			while (isspace((unsigned char)text[pos])) ++pos;
+			++pos;
+		}
+		out_spans.emplace_back(first, pos);
+	}
+	return true;
+}
+
+void line_edit::compute(size_t n) {
+	node& x = nodes[n];
+	x.value = apply_operator(x.op, nodes[x.left].value, nodes[x.right].value);
+	++recomputed;
+}
+
+bool line_edit::build() {
+	// shunting yard over token positions, as eval::to_postfix()
+	auto precedence = [](token_type t) {
+		return (t == token_type::op_mul || t == token_type::op_div) ? 2 : 1;
+	};
+	nodes.clear();
+	node_of.assign(tokens.size(), 0);
+	vector<size_t> ops, operands;
+	auto reduce = [&] {
+		node n;
+		n.op = tokens[ops.back()].type;
+		n.right = operands.back();
+		operands.pop_back();
+		n.left = operands.back();
+		operands.pop_back();
+		node_of[ops.back()] = nodes.size();
+		ops.pop_back();
+		nodes[n.left].parent = nodes[n.right].parent = nodes.size();
+		operands.push_back(nodes.size());
+		nodes.push_back(n);
+		compute(nodes.size() - 1);
+	};
+	for (size_t i = 0; i < tokens.size(); ++i) {
+		const token& t = tokens[i];
+		switch (t.type) {
+			case token_type::number: {
+				node n;
+				n.op = t.type;
+				n.value = literal_value(t, options);
+				node_of[i] = nodes.size();
+				operands.push_back(nodes.size());
+				nodes.push_back(n);
+				break;
+			}
+			case token_type::open_bracket:
+				ops.push_back(i);
+				break;
+			case token_type::close_bracket:
+				while (tokens[ops.back()].type != token_type::open_bracket) reduce();
+				ops.pop_back();
+				break;
+			case token_type::op_add:
+			case token_type::op_sub:
+			case token_type::op_mul:
+			case token_type::op_div:
+				while (not ops.empty() && tokens[ops.back()].type != token_type::open_bracket &&
+					precedence(t.type) <= precedence(tokens[ops.back()].type)) reduce();
+				ops.push_back(i);
+				break;
+			default:
+				// variables take the full path
+				return false;
+		}
+	}
+	while (not ops.empty()) reduce();
+	nodes.back().parent = nodes.size();
+	return true;
+}
+
+bool line_edit::splice(const string& line, vector<size_t>& edited) {
+	edited.clear();
+	size_t old_size = text.size();
+	token_list whole;
+	vector<pair<size_t, size_t>> whole_spans;
+	if (not valid) {
+		relexed = line.size();
+		if (not lex(line, 0, line.size(), whole, whole_spans) || not tokenizer::valid(whole))
+			return false;
+		tokens = move(whole);
+		spans = move(whole_spans);
+		valid = false;
+		return true;
+	}
+	size_t prefix = 0;
+	while (prefix < old_size && prefix < line.size() && text[prefix] == line[prefix]) ++prefix;
+	size_t suffix = 0;
+	while (suffix < old_size - prefix && suffix < line.size() - prefix &&
+		text[old_size - 1 - suffix] == line[line.size() - 1 - suffix]) ++suffix;
+	// tokens a..b touch the edit, with one token of context around
+	size_t a = 0;
+	while (a < tokens.size() && spans[a].second < prefix) ++a;
+	if (a > 0) --a;
+	size_t b = tokens.size() - 1;
+	while (b > a && spans[b].first > old_size - suffix) --b;
+	bool context_after = b + 1 < tokens.size();
+	if (context_after) ++b;
+	size_t begin = min(spans[a].first, prefix);
+	size_t end = max(spans[b].second, old_size - suffix);
+	size_t new_end = end + line.size() - old_size;
+	token_list middle;
+	vector<pair<size_t, size_t>> middle_spans;
+	relexed = new_end - begin;
+	if (not lex(line, begin, new_end, middle, middle_spans)) return false;
+	// the context token after the edit must come out unchanged
+	if (context_after && (middle.empty() || middle.back().type != tokens[b].type ||
+		middle.back().text != tokens[b].text || middle_spans.back().second != new_end)) {
+		valid = false;
+		return splice(line, edited);
+	}
+	bool same_shape = middle.size() == b - a + 1;
+	for (size_t i = 0; same_shape && i < middle.size(); ++i) {
+		token_type x = middle[i].type, y = tokens[a + i].type;
+		bool additive = (x == token_type::op_add || x == token_type::op_sub) &&
+			(y == token_type::op_add || y == token_type::op_sub);
+		bool multiplicative = (x == token_type::op_mul || x == token_type::op_div) &&
+			(y == token_type::op_mul || y == token_type::op_div);
+		same_shape = x == y || additive || multiplicative;
+	}
+	if (not same_shape) {
+		// a new tree, the tokens are still only lexed around the edit
+		whole.reserve(tokens.size() - (b - a + 1) + middle.size());
+		whole.insert(whole.end(), tokens.begin(), tokens.begin() + a);
+		whole.insert(whole.end(), middle.begin(), middle.end());
+		whole.insert(whole.end(), tokens.begin() + b + 1, tokens.end());
+		if (not tokenizer::valid(whole)) return false;
+		whole_spans.insert(whole_spans.end(), spans.begin(), spans.begin() + a);
+		whole_spans.insert(whole_spans.end(), middle_spans.begin(), middle_spans.end());
+		whole_spans.insert(whole_spans.end(), spans.begin() + b + 1, spans.end());
+		for (size_t i = a + middle.size(); i < whole_spans.size(); ++i) {
+			whole_spans[i].first += line.size() - old_size;
+			whole_spans[i].second += line.size() - old_size;
+		}
+		tokens = move(whole);
+		spans = move(whole_spans);
+		valid = false;
+		return true;
+	}
+	// same token classes, so the line is still valid
+	for (size_t i = 0; i < middle.size(); ++i) {
+		if (middle[i].type != tokens[a + i].type || middle[i].text != tokens[a + i].text)
+			edited.push_back(a + i);
+		tokens[a + i] = move(middle[i]);
+		spans[a + i] = middle_spans[i];
+	}
+	for (size_t i = b + 1; i < tokens.size(); ++i) {
+		spans[i].first += line.size() - old_size;
+		spans[i].second += line.size() - old_size;
+	}
+	return true;
+}
+
+bool line_edit::evaluate(const string& line, line_result& r) {
+	relexed = 0;
+	recomputed = 0;
+	if (options.pairwise_terms > 1 || options.canonical_chains) return false;
+	vector<size_t> edited;
+	// a line with errors leaves the last good one to compare with
+	if (not splice(line, edited)) return false;
+	if (valid) {
+		// ancestors of the edited nodes, children before parents
+		vector<size_t> changed;
+		for (size_t i : edited) {
+			const token& t = tokens[i];
+			node& n = nodes[node_of[i]];
+			if (t.type == token_type::number) {
+				n.value = literal_value(t, options);
+				++recomputed;
+			}
+			else {
+				n.op = t.type;
+				changed.push_back(node_of[i]);
+			}
+			for (size_t p = n.parent; p < nodes.size(); p = nodes[p].parent)
+				changed.push_back(p);
+		}
+		sort(changed.begin(), changed.end());
+		changed.erase(unique(changed.begin(), changed.end()), changed.end());
+		for (size_t n : changed) compute(n);
+	}
+	else if (not build()) return false;
+	valid = true;
+	text = line;
+	r = exact_result(nodes.back().value);
+	return true;
+}
+
+size_t line_edit::relexed_chars() const { return relexed; }
+size_t line_edit::recomputed_nodes() const { return recomputed; }
+
+/*  ~ Binary results ~
+
+	--output binary writes results for other programs without the text
+	round trip. The stream starts with a 16 byte header:
+
+		char     magic[4]     "SEVB"
+		uint16   version      1
+		uint16   header_size  16
+		uint32   flags        bit 0: errors are NaN payload codes
+		uint32   reserved     0
+
+	followed by one little endian IEEE double per input line. A line
+	without a result is a quiet NaN whose payload (low 51 bits) is its
+	result_code; NaN results of the arithmetic are written as the
+	canonical quiet NaN, payload 0. Integer results are converted to
+	double. All fields are little endian. */
+
+enum class result_code : unsigned {
+	value = 0,
+	blank = 1,
+	parse_error = 2,
+	error = 3
+};
+
+const unsigned long long quiet_nan_bits = 0x7ff8000000000000ULL;
+
+bool host_is_little_endian() {
+	const unsigned short one = 1;
+	unsigned char first{};
+	memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+void store_le64(unsigned long long v, char* p) {
+	if (host_is_little_endian()) {
+		memcpy(p, &v, 8);
+		return;
+	}
+	for (int i = 0; i < 8; ++i) p[i] = (char)((v >> (8 * i)) & 0xff);
+}
+
+void write_binary_header(output_buffer& out) {
+	char header[16] = { 'S', 'E', 'V', 'B', 1, 0, 16, 0, 1, 0, 0, 0, 0, 0, 0, 0 };
+	out.write(header, sizeof(header));
+}
+
+void write_binary_result(output_buffer& out, const line_result& r) {
+	unsigned long long bits = quiet_nan_bits;
+	switch (r.status) {
+		case line_status::ok: {
+			double v = r.integer ? (double)r.integer_value : r.value;
+			if (v == v) memcpy(&bits, &v, 8);
+			break;
+		}
+		case line_status::blank:
+			bits |= (unsigned long long)result_code::blank;
+			break;
+		case line_status::parse_error:
+			bits |= (unsigned long long)result_code::parse_error;
+			break;
+		case line_status::error:
+			bits |= (unsigned long long)result_code::error;
+			break;
+	}
+	char* p = out.reserve(8);
+	store_le64(bits, p);
+	out.commit(8);
+}
+
+// text of an ok result, exact for integers unless a precision is given
+size_t format_result(const line_result& r, int precision, char* out) {
+	if (r.integer && precision <= 0) return format_integer(r.integer_value, out);
+	return format_double(r.integer ? (double)r.integer_value : r.value, precision, out);
+}
+
+void write_result(output_buffer& out, const line_result& r, const cli_options& opt) {
+	if (opt.binary) {
+		write_binary_result(out, r);
+		return;
+	}
+	int precision = opt.precision;
+	switch (r.status) {
+		case line_status::ok: {
+			// formatted in place, same text as the REPL
+			char* p = out.reserve(32);
+			out.commit(format_result(r, precision, p));
+			break;
+		}
+		case line_status::blank:
+			break;
+		case line_status::parse_error:
+			out.write("-- parsing error --", 19);
+			break;
+		case line_status::error:
+			out.write("-- error --", 11);
+			break;
+	}
+	out.put('\n');
+}
+
+// items produced out of order, taken in sequence order
+template <class T>
+class reorder_buffer {
+private:
+	mutex lock;
+	condition_variable ready_cv;
+	map<size_t, T> ready;
+	size_t next;
+public:
+	reorder_buffer();
+	void put(size_t seq, T item);
+	// waits for the next item in sequence
+	T take();
+	// next item in sequence if it is ready
+	bool try_take(T& item);
+};
+
+template <class T>
+reorder_buffer<T>::reorder_buffer() : lock{}, ready_cv{}, ready{}, next{} {}
+
+template <class T>
+void reorder_buffer<T>::put(size_t seq, T item) {
+	{
+		lock_guard<mutex> g(lock);
+		ready.emplace(seq, move(item));
+	}
+	ready_cv.notify_all();
+}
+
+template <class T>
+T reorder_buffer<T>::take() {
+	unique_lock<mutex> g(lock);
+	ready_cv.wait(g, [this] { return ready.count(next) != 0; });
+	auto it = ready.find(next);
+	T item = move(it->second);
+	ready.erase(it);
+	++next;
+	return item;
+}
+
+template <class T>
+bool reorder_buffer<T>::try_take(T& item) {
+	lock_guard<mutex> g(lock);
+	auto it = ready.find(next);
+	if (it == ready.end()) return false;
+	item = move(it->second);
+	ready.erase(it);
+	++next;
+	return true;
+}
+
+/*  ~ Cells batch ~
+
+	--cells evaluates the lines in order, but a run of definitions of new
+	cells is recalculated once, when the next line needs the sheet: a
+	line that is not a definition, or a definition of a cell that
+	already exists (a new cell is read by no earlier formula, so its
+	definition changes none of the pending results). A model of many
+	cells becomes one recalculation whose big levels run in parallel,
+	and every line still gets the result it would get on its own. */
+
+int run_batch_cells(const cli_options& opt, output_buffer& out, program_cache* cache) {
+	line_reader in(stdin);
+	line_evaluator state(opt.compile, cache, opt.result_slots);
+	cell_sheet sheet(opt.compile);
+	// definitions not written yet, names of the ok ones
+	vector<line_status> defined;
+	vector<string> names;
+	auto flush = [&] {
+		vector<line_result> values = sheet.get(names);
+		size_t next = 0;
+		for (line_status status : defined) {
+			line_result r;
+			r.status = status;
+			write_result(out, status == line_status::ok ? values[next++] : r, opt);
+		}
+		defined.clear();
+		names.clear();
+	};
+	string line, name, formula;
+	while (in.next(line)) {
+		if (cell_sheet::split_definition(line, name, formula)) {
+			if (sheet.has(name)) flush();
+			line_status status = sheet.define(name, formula);
+			defined.push_back(status);
+			if (status == line_status::ok) names.push_back(name);
+			continue;
+		}
+		flush();
+		write_result(out, evaluate_cell_line(sheet, state, line), opt);
+	}
+	flush();
+	return 0;
+}
+
+/*  ~ Parallel batch ~
+
+	The reader cuts the input into chunks of lines and submits one task
+	per chunk to the work stealing pool. Every worker evaluates with its
+	own line_evaluator. Finished chunks go to a reorder buffer and the
+	main thread writes them in input order. At most a few chunks per
+	worker are in flight, which bounds memory on endless input. */
+
+int run_batch_parallel(const cli_options& opt, output_buffer& out, program_cache* cache) {
+	const size_t chunk_lines = 4096;
+	thread_pool pool(opt.threads);
+	const size_t max_in_flight = 4 * pool.size();
+	vector<line_evaluator> states(pool.size(),
+		line_evaluator(opt.compile, cache, opt.result_slots));
+	reorder_buffer<vector<line_result>> done;
+	line_reader in(stdin);
+	size_t submitted = 0;
+	size_t written = 0;
+	vector<line_result> results;
+	bool more = true;
+	while (more) {
+		auto chunk = make_shared<vector<string>>();
+		chunk->reserve(chunk_lines);
+		string line;
+		while (chunk->size() < chunk_lines && (more = in.next(line)))
+			chunk->push_back(move(line));
+		if (not chunk->empty()) {
+			size_t seq = submitted++;
+			pool.submit([&pool, &states, &done, chunk, seq] {
+				line_evaluator& state = states[pool.worker_index()];
+				vector<line_result> r;
+				r.reserve(chunk->size());
+				for (string& l : *chunk) r.push_back(state.evaluate(l));
+				done.put(seq, move(r));
+			});
+		}
+		// write what is ready, wait when too much is in flight
+		while (written < submitted) {
+			bool wait = (submitted - written >= max_in_flight) || not more;
+			if (wait) results = done.take();
+			else if (not done.try_take(results)) break;
+			for (const line_result& r : results) write_result(out, r, opt);
+			++written;
+		}
+	}
+	return 0;
+}
+
+/*  ~ Shared subexpressions ~
+
+	Lines of one input often repeat big bracketed subexpressions.
+	With --share MB the distinct lines of a --dedup window are evaluated
+	by shared_evaluator: a group "( ... )" of at least min_text
+	characters is looked up by its normalized text in a table shared by
+	all workers, and on a hit the group is not lexed or computed at
+	all. Other groups are computed (recursively, inner groups first)
+	and entered while the table is below its memory budget; the table
+	is emptied after every window. The arithmetic is that of
+	apply_operator(), so results equal full evaluation. Lines with
+	errors or variables, and pairwise or sorted chains, take the full
+	path. */
+
+class subexpression_cache {
+private:
+	class shard {
+	public:
+		mutex lock;
+		unordered_map<string, exact_value> values;
+		size_t bytes{};
+	};
+	// sharded by hash, few workers meet on one lock
+	vector<unique_ptr<shard>> shards;
+	size_t shard_bytes;
+	// largest window, for print()
+	size_t peak_bytes;
+	atomic<size_t> hits;
+	atomic<size_t> misses;
+public:
+	subexpression_cache(size_t max_bytes);
+	bool find(const string& key, unsigned long long h, exact_value& out);
+	// false when the shard is at its budget
+	bool insert(const string& key, unsigned long long h, const exact_value& v);
+	void clear();
+	void print(ostream& out) const;
+};
+
+subexpression_cache::subexpression_cache(size_t max_bytes)
+	: shards{}, shard_bytes{}, peak_bytes{}, hits{ 0 }, misses{ 0 } {
+	const size_t count = 64;
+	for (size_t i = 0; i < count; ++i) shards.emplace_back(new shard);
+	shard_bytes = max_bytes / count;
+}
+
+bool subexpression_cache::find(const string& key, unsigned long long h, exact_value& out) {
+	shard& s = *shards[h % shards.size()];
+	lock_guard<mutex> g(s.lock);
+	auto it = s.values.find(key);
+	if (it == s.values.end()) {
+		++misses;
+		return false;
+	}
+	++hits;
+	out = it->second;
+	return true;
+}
+
+bool subexpression_cache::insert(const string& key, unsigned long long h,
+	const exact_value& v) {
+	shard& s = *shards[h % shards.size()];
+	size_t bytes = sizeof(string) + sizeof(exact_value) + key.size() + 32;
+	lock_guard<mutex> g(s.lock);
+	if (s.bytes + bytes > shard_bytes) return false;
+	if (s.values.emplace(key, v).second) s.bytes += bytes;
+	return true;
+}
+
+void subexpression_cache::clear() {
+	size_t bytes = 0;
+	for (auto& s : shards) {
+		lock_guard<mutex> g(s->lock);
+		bytes += s->bytes;
+		s->values.clear();
+		s->bytes = 0;
+	}
+	peak_bytes = max(peak_bytes, bytes);
+}
+
+void subexpression_cache::print(ostream& out) const {
+	out << "shared: " << hits << " group hits, " << misses << " group misses, "
+		<< peak_bytes << " bytes\n";
+}
+
+// worker state evaluating normalized lines over a subexpression_cache
+class shared_evaluator {
+private:
+	subexpression_cache& cache;
+	compile_options options;
+	tokenizer tk;
+	string key;
+	// closing bracket of every open bracket of the line
+	vector<size_t> match;
+	// groups shorter than this are cheaper to compute than to look up
+	static const size_t min_text = 16;
+	// deeper nesting takes the full path
+	static const size_t max_depth = 256;
+	// value of text[begin, end), false on errors or variables
+	bool span(const string& text, size_t begin, size_t end, size_t depth, exact_value& out);
+	// operands of one level, lexed between its groups
+	bool lex(const string& text, size_t begin, size_t end, vector<exact_value>& values,
+		vector<token_type>& ops, bool& operand_expected);
+public:
+	shared_evaluator(subexpression_cache& c, const compile_options& opt);
+	// evaluates a normalized line, false when it needs the full path
+	bool evaluate(const string& text, line_result& r);
+};
+
+shared_evaluator::shared_evaluator(subexpression_cache& c, const compile_options& opt)
+	: cache(c), options{ opt }, tk{ string{} }, key{}, match{} {}
+
+bool shared_evaluator::evaluate(const string& text, line_result& r) {
+	if (text.empty() || options.pairwise_terms > 1 || options.canonical_chains) return false;
+	match.assign(text.size(), 0);
+	vector<size_t> open;
+	for (size_t i = 0; i < text.size(); ++i) {
+		if (text[i] == '(') open.push_back(i);
+		else if (text[i] == ')') {
+			if (open.empty()) return false;
+			match[open.back()] = i;
+			open.pop_back();
+		}
+	}
+	if (not open.empty()) return false;
+	exact_value v;
+	if (not span(text, 0, text.size(), 0, v)) return false;
+	r = exact_result(v);
+	return true;
+}
+
+bool shared_evaluator::lex(const string& text, size_t begin, size_t end,
+	vector<exact_value>& values, vector<token_type>& ops, bool& operand_expected) {
+	if (begin == end) return true;
+	tk.reset(text.substr(begin, end - begin));
+	tk.lex();
+	if (tk.error_state()) return false;
+	for (const token& t : tk.tokens_ref()) {
+		bool operand = t.type == token_type::number;
+		if (operand != operand_expected) return false;
+		if (operand) values.push_back(literal_value(t, options));
+		else if (t.type == token_type::op_add || t.type == token_type::op_sub ||
+			t.type == token_type::op_mul || t.type == token_type::op_div) ops.push_back(t.type);
+		else return false;
+		operand_expected = not operand;
+	}
+	return true;
+}
+
+bool shared_evaluator::span(const string& text, size_t begin, size_t end, size_t depth,
+	exact_value& out) {
+	if (depth > max_depth) return false;
+	vector<exact_value> values;
+	vector<token_type> ops;
+	bool operand_expected = true;
+	size_t piece = begin;
+	for (size_t i = begin; i < end; ++i) {
+		if (text[i] != '(') continue;
+		if (not lex(text, piece, i, values, ops, operand_expected) || not operand_expected)
+			return false;
+		size_t close = match[i];
+		exact_value v;
+		bool shared = close - i - 1 >= min_text;
+		unsigned long long h{};
+		if (shared) {
+			key.assign(text, i + 1, close - i - 1);
+			h = result_cache::hash(key);
+		}
+		if (not shared || not cache.find(key, h, v)) {
+			if (not span(text, i + 1, close, depth + 1, v)) return false;
+			if (shared) {
+				key.assign(text, i + 1, close - i - 1);
+				cache.insert(key, h, v);
+			}
+		}
+		values.push_back(v);
+		operand_expected = false;
+		i = close;
+		piece = close + 1;
+	}
+	if (not lex(text, piece, end, values, ops, operand_expected) || operand_expected)
+		return false;
+	// * and / bind first, both levels left to right, as the postfix
+	// order of eval::to_postfix()
+	exact_value sum{}, term = values[0];
+	token_type add_op{};
+	bool have_sum = false;
+	for (size_t k = 0; k < ops.size(); ++k) {
+		if (ops[k] == token_type::op_mul || ops[k] == token_type::op_div) {
+			term = apply_operator(ops[k], term, values[k + 1]);
+			continue;
+		}
+		sum = have_sum ? apply_operator(add_op, sum, term) : term;
+		have_sum = true;
+		add_op = ops[k];
+		term = values[k + 1];
+	}
+	out = have_sum ? apply_operator(add_op, sum, term) : term;
+	return true;
+}
+
+/*  ~ Deduplicated batch ~
+
+	Inputs with many repeated lines are cheaper to evaluate once per
+	distinct line. --dedup reads the input in windows of dedup_lines
+	lines. Worker tasks normalize and hash the lines of a window, one
+	thread enters them in an open addressing table of distinct lines,
+	the workers evaluate every distinct line once and the results are
+	written to every position of the window in input order. */
+
+// table of the distinct normalized lines of a window
+class distinct_lines {
+private:
+	// power of two slots, distinct index + 1, 0 is empty
+	vector<size_t> slots;
+public:
+	// first line of every distinct key
+	vector<size_t> first{};
+	// distinct index of every line
+	vector<size_t> index_of{};
+	void build(const vector<string>& keys, const vector<unsigned long long>& hashes);
+};
+
+void distinct_lines::build(const vector<string>& keys,
+	const vector<unsigned long long>& hashes) {
+	size_t n = 16;
+	while (n < 2 * keys.size()) n *= 2;
+	slots.assign(n, 0);
+	first.clear();
+	index_of.resize(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i) {
+		size_t s = hashes[i] & (n - 1);
+		while (slots[s] != 0 && keys[first[slots[s] - 1]] != keys[i]) s = (s + 1) & (n - 1);
+		if (slots[s] == 0) {
+			first.push_back(i);
+			slots[s] = first.size();
+		}
+		index_of[i] = slots[s] - 1;
+	}
+}
+
+int run_batch_dedup(const cli_options& opt, output_buffer& out, program_cache* cache) {
+	const size_t dedup_lines = 1 << 20;
+	const size_t chunk_lines = 4096;
+	thread_pool pool(opt.threads);
+	// one state per worker and one for this thread, which helps while waiting
+	vector<line_evaluator> states(pool.size() + 1,
+		line_evaluator(opt.compile, cache, opt.result_slots));
+	subexpression_cache groups(opt.share_bytes);
+	vector<shared_evaluator> shared(pool.size() + 1, shared_evaluator(groups, opt.compile));
+	line_reader in(stdin);
+	vector<string> lines, keys;
+	vector<unsigned long long> hashes;
+	vector<line_result> results;
+	distinct_lines table;
+	size_t total = 0, distinct = 0;
+	bool more = true;
+	while (more) {
+		lines.clear();
+		string line;
+		while (lines.size() < dedup_lines && (more = in.next(line))) lines.push_back(move(line));
+		if (lines.empty()) break;
+		keys.resize(lines.size());
+		hashes.resize(lines.size());
+		{
+			task_group group(pool);
+			for (size_t b = 0; b < lines.size(); b += chunk_lines) {
+				size_t e = min(b + chunk_lines, lines.size());
+				group.run([&lines, &keys, &hashes, b, e] {
+					for (size_t i = b; i < e; ++i) {
+						program_cache::normalize(lines[i], keys[i]);
+						hashes[i] = result_cache::hash(keys[i]);
+					}
+				});
+			}
+			group.wait();
+		}
+		table.build(keys, hashes);
+		results.assign(table.first.size(), line_result{});
+		{
+			task_group group(pool);
+			for (size_t b = 0; b < table.first.size(); b += chunk_lines) {
+				size_t e = min(b + chunk_lines, table.first.size());
+				group.run([&, b, e] {
+					int w = pool.worker_index();
+					size_t s = w < 0 ? states.size() - 1 : (size_t)w;
+					for (size_t u = b; u < e; ++u) {
+						size_t i = table.first[u];
+						if (opt.share_bytes == 0 || not shared[s].evaluate(keys[i], results[u]))
+							results[u] = states[s].evaluate(lines[i]);
+					}
+				});
+			}
+			group.wait();
+		}
+		for (size_t i = 0; i < lines.size(); ++i) write_result(out, results[table.index_of[i]], opt);
+		total += lines.size();
+		distinct += table.first.size();
+		groups.clear();
+	}
+	if (opt.cache_stats) {
+		cerr << "dedup: " << total << " lines, " << distinct << " distinct\n";
+		if (opt.share_bytes > 0) groups.print(cerr);
+	}
+	return 0;
+}
+
+/*  ~ Pipelined batch ~
+
+	Four stages, each on its own thread: read lines, parse (tokenize and
+	compile), evaluate, write. Neighbouring stages are connected by
+	bounded lock-free single producer / single consumer rings. A ring
+	slot carries a whole batch of lines, so the ring indices are touched
+	once per batch. A full ring stops its producer, which gives natural
+	backpressure from the slowest stage. Every stage counts the time it
+	spends working and waiting, --pipeline-stats prints it to stderr. */
+
+template <class T>
+class spsc_ring {
+private:
+	vector<T> slots;
+	size_t mask;
+	// next slot to pop, written by the consumer only
+	alignas(64) atomic<size_t> head;
+	// next slot to push, written by the producer only
+	alignas(64) atomic<size_t> tail;
+	alignas(64) atomic<bool> closed;
+public:
+	// capacity is rounded up to a power of two
+	spsc_ring(size_t capacity);
+	// moves from item on success, false if full
+	bool try_push(T& item);
+	// false if empty
+	bool try_pop(T& item);
+	// producer: no more items
+	void close();
+	bool is_closed() const;
+	size_t size() const;
+	size_t capacity() const;
+};
+
+template <class T>
+spsc_ring<T>::spsc_ring(size_t capacity)
+	: slots{}, mask{}, head{ 0 }, tail{ 0 }, closed{ false } {
+	size_t n = 1;
+	while (n < capacity) n *= 2;
+	slots.resize(n);
+	mask = n - 1;
+}
+
+template <class T>
+bool spsc_ring<T>::try_push(T& item) {
+	size_t t = tail.load(memory_order_relaxed);
+	if (t - head.load(memory_order_acquire) == slots.size()) return false;
+	slots[t & mask] = move(item);
+	tail.store(t + 1, memory_order_release);
+	return true;
+}
+
+template <class T>
+bool spsc_ring<T>::try_pop(T& item) {
+	size_t h = head.load(memory_order_relaxed);
+	if (h == tail.load(memory_order_acquire)) return false;
+	item = move(slots[h & mask]);
+	head.store(h + 1, memory_order_release);
+	return true;
+}
+
+template <class T>
+void spsc_ring<T>::close() { closed.store(true, memory_order_release); }
+
+template <class T>
+bool spsc_ring<T>::is_closed() const { return closed.load(memory_order_acquire); }
+
+template <class T>
+size_t spsc_ring<T>::size() const {
+	return tail.load(memory_order_acquire) - head.load(memory_order_acquire);
+}
+
+template <class T>
+size_t spsc_ring<T>::capacity() const { return slots.size(); }
+
+// time a pipeline stage spent working and waiting
+class stage_stats {
+public:
+	const char* name{};
+	size_t batches{};
+	size_t items{};
+	double busy{};
+	double wait_input{};
+	double wait_output{};
+	// sum of the input ring fill seen at every pop
+	size_t input_fill{};
+	size_t input_capacity{};
+
+	void print(ostream& out) const;
+};
+
+void stage_stats::print(ostream& out) const {
+	double total = busy + wait_input + wait_output;
+	if (total <= 0) total = 1;
+	out << name << "\tbatches " << batches << "\titems " << items
+		<< "\tbusy " << (100 * busy / total) << "%"
+		<< "\twait in " << (100 * wait_input / total) << "%"
+		<< "\twait out " << (100 * wait_output / total) << "%";
+	if (input_capacity > 0 && batches > 0)
+		out << "\tinput ring " << ((double)input_fill / batches) << "/" << input_capacity;
+	out << "\n";
+}
+
+double seconds_since(chrono::steady_clock::time_point t) {
+	return chrono::duration<double>(chrono::steady_clock::now() - t).count();
+}
+
+// blocking push, counts waiting time
+template <class T>
+void pipeline_push(spsc_ring<T>& ring, T& item, stage_stats& stats) {
+	if (ring.try_push(item)) return;
+	auto start = chrono::steady_clock::now();
+	while (not ring.try_push(item)) this_thread::yield();
+	stats.wait_output += seconds_since(start);
+}
+
+// blocking pop, false when the producer closed the ring and it is empty
+template <class T>
+bool pipeline_pop(spsc_ring<T>& ring, T& item, stage_stats& stats) {
+	size_t fill = ring.size();
+	if (not ring.try_pop(item)) {
+		auto start = chrono::steady_clock::now();
+		for (;;) {
+			if (ring.try_pop(item)) break;
+			if (ring.is_closed()) {
+				// items pushed before close() are visible now
+				if (ring.try_pop(item)) break;
+				stats.wait_input += seconds_since(start);
+				return false;
+			}
+			this_thread::yield();
+		}
+		stats.wait_input += seconds_since(start);
+	}
+	stats.input_fill += fill;
+	stats.input_capacity = ring.capacity();
+	return true;
+}
+
+// parse stage output: a compiled program or the parse outcome
+class parsed_line {
+public:
+	line_status status{};
+	prepared_expression expr{};
+};
+
+int run_batch_pipeline(const cli_options& opt, output_buffer& out, program_cache* cache) {
+	const size_t batch_lines = 1024;
+	const size_t ring_slots = 8;
+	spsc_ring<vector<string>> read_ring(ring_slots);
+	spsc_ring<vector<parsed_line>> parse_ring(ring_slots);
+	spsc_ring<vector<line_result>> eval_ring(ring_slots);
+	stage_stats read_stats, parse_stats, eval_stats, write_stats;
+	read_stats.name = "read";
+	parse_stats.name = "parse";
+	eval_stats.name = "eval";
+	write_stats.name = "write";
+
+	thread reader([&] {
+		line_reader in(stdin);
+		bool more = true;
+		while (more) {
+			auto start = chrono::steady_clock::now();
+			vector<string> batch;
+			batch.reserve(batch_lines);
+			string line;
+			while (batch.size() < batch_lines && (more = in.next(line)))
+				batch.push_back(move(line));
+			read_stats.busy += seconds_since(start);
+			if (batch.empty()) break;
+			++read_stats.batches;
+			read_stats.items += batch.size();
+			pipeline_push(read_ring, batch, read_stats);
+		}
+		read_ring.close();
+	});
+
+	thread parser([&] {
+		vector<string> lines;
+		// the stage only compiles, results are not remembered here
+		line_evaluator state(opt.compile, cache);
+		while (pipeline_pop(read_ring, lines, parse_stats)) {
+			auto start = chrono::steady_clock::now();
+			vector<parsed_line> batch(lines.size());
+			for (size_t i = 0; i < lines.size(); ++i)
+				batch[i].status = state.prepare(lines[i], batch[i].expr);
+			parse_stats.busy += seconds_since(start);
+			++parse_stats.batches;
+			parse_stats.items += batch.size();
+			pipeline_push(parse_ring, batch, parse_stats);
+		}
+		parse_ring.close();
+	});
+
+	thread evaluator([&] {
+		vector<parsed_line> parsed;
+		while (pipeline_pop(parse_ring, parsed, eval_stats)) {
+			auto start = chrono::steady_clock::now();
+			vector<line_result> batch(parsed.size());
+			for (size_t i = 0; i < parsed.size(); ++i) {
+				if (parsed[i].status == line_status::ok)
+					batch[i] = run_program(*parsed[i].expr.prog, &parsed[i].expr.literals);
+				else
+					batch[i].status = parsed[i].status;
+			}
+			eval_stats.busy += seconds_since(start);
+			++eval_stats.batches;
+			eval_stats.items += batch.size();
+			pipeline_push(eval_ring, batch, eval_stats);
+		}
+		eval_ring.close();
+	});
+
+	vector<line_result> results;
+	while (pipeline_pop(eval_ring, results, write_stats)) {
+		auto start = chrono::steady_clock::now();
+		for (const line_result& r : results) write_result(out, r, opt);
+		write_stats.busy += seconds_since(start);
+		++write_stats.batches;
+		write_stats.items += results.size();
+	}
+	out.flush();
+	reader.join();
+	parser.join();
+	evaluator.join();
+	if (opt.pipeline_stats) {
+		read_stats.print(cerr);
+		parse_stats.print(cerr);
+		eval_stats.print(cerr);
+		write_stats.print(cerr);
+	}
+	return 0;
+}
+
+/*  ~ CSV input ~
+
+	--csv FILE --expr EXPR evaluates one expression for every row of a
+	CSV (or --tsv tab separated) file. Header names bind to the variables
+	of the expression, so the formula is compiled once and the rows run
+	through column_evaluator in blocks. The file is mapped into memory
+	and fields are pointer ranges into it, nothing is copied. Field ends
+	are found 16 bytes at a time with SSE2 compares. Quoted fields
+	("a,b", "" escapes) are supported. A row with a missing or
+	non-numeric value in a used column gives an error result. */
+
+class csv_field {
+public:
+	const char* begin{};
+	const char* end{};
+	bool quoted{};
+
+	// text with "" escapes resolved
+	string text() const;
+};
+
+string csv_field::text() const {
+	string s;
+	for (const char* p = begin; p < end; ++p) {
+		s += *p;
+		if (quoted && *p == '"' && p + 1 < end && p[1] == '"') ++p;
+	}
+	return s;
+}
+
+// first delimiter or new line in [p, end)
+const char* find_field_end(const char* p, const char* end, char delimiter) {
+#if defined(SIMPLE_EVAL_X86) && defined(__SSE2__)
+	const __m128i d = _mm_set1_epi8(delimiter);
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; p + 16 <= end; p += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)p);
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, d),
+			_mm_cmpeq_epi8(block, nl)));
+		if (mask != 0) return p + __builtin_ctz((unsigned)mask);
+	}
+#endif
+	for (; p < end; ++p)
+		if (*p == delimiter || *p == '\n') return p;
+	return end;
+}
+
+class csv_reader {
+private:
+	const char* pos;
+	const char* end;
+	char delimiter;
+public:
+	csv_reader(const char* data, size_t size, char delim);
+	// fields of the next record, false at the end of the input
+	bool next(vector<csv_field>& fields);
+};
+
+csv_reader::csv_reader(const char* data, size_t size, char delim)
+	: pos{ data }, end{ data + size }, delimiter{ delim } {}
+
+bool csv_reader::next(vector<csv_field>& fields) {
+	fields.clear();
+	if (pos >= end) return false;
+	for (;;) {
+		csv_field f;
+		if (pos < end && *pos == '"') {
+			// quoted field, "" is an escaped quote
+			f.quoted = true;
+			f.begin = ++pos;
+			for (;;) {
+				const char* q = (const char*)memchr(pos, '"', end - pos);
+				if (q == nullptr) {
+					pos = end;
+					break;
+				}
+				if (q + 1 < end && q[1] == '"') {
+					pos = q + 2;
+					continue;
+				}
+				pos = q + 1;
+				break;
+			}
+			f.end = (pos > f.begin && pos[-1] == '"') ? pos - 1 : pos;
+			// ignore anything between the closing quote and the delimiter
+			pos = find_field_end(pos, end, delimiter);
+		}
+		else {
+			f.begin = pos;
+			pos = find_field_end(pos, end, delimiter);
+			f.end = pos;
+			if (f.end > f.begin && f.end[-1] == '\r') --f.end;
+		}
+		fields.push_back(f);
+		if (pos >= end) return true;
+		if (*pos++ == '\n') return true;
+	}
+}
+
+// exact decimal text to double: [blanks][sign]digits[.digits][e[sign]digits][blanks]
+bool parse_number(const char* b, const char* e, double& value) {
+	static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+		1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+		1e20, 1e21, 1e22 };
+	while (b < e && (*b == ' ' || *b == '\t')) ++b;
+	while (e > b && (e[-1] == ' ' || e[-1] == '\t')) --e;
+	const char* p = b;
+	bool negative = false;
+	if (p < e && (*p == '+' || *p == '-')) negative = (*p++ == '-');
+	unsigned long long mantissa = 0;
+	int digits = 0;
+	int scale = 0;
+	bool any = false;
+	for (; p < e && isdigit((unsigned char)*p); ++p) {
+		any = true;
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (unsigned)(*p - '0');
+			if (mantissa != 0) ++digits;
+		}
+		else {
+			++scale;
+			digits = 20;
+		}
+	}
+	if (p < e && *p == '.') {
+		for (++p; p < e && isdigit((unsigned char)*p); ++p) {
+			any = true;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (unsigned)(*p - '0');
+				if (mantissa != 0) ++digits;
+				--scale;
+			}
+			else digits = 20;
+		}
+	}
+	if (not any) return false;
+	if (p < e && (*p == 'e' || *p == 'E')) {
+		++p;
+		bool negative_exp = false;
+		if (p < e && (*p == '+' || *p == '-')) negative_exp = (*p++ == '-');
+		if (p == e || not isdigit((unsigned char)*p)) return false;
+		int exp = 0;
+		for (; p < e && isdigit((unsigned char)*p); ++p)
+			if (exp < 10000) exp = exp * 10 + (*p - '0');
+		scale += negative_exp ? -exp : exp;
+	}
+	if (p != e) return false;
+	// both operands exact, one correctly rounded operation
+	if (digits <= 19 && mantissa <= (1ULL << 53) && scale >= -22 && scale <= 22) {
+		double v = (double)mantissa;
+		v = scale < 0 ? v / pow10[-scale] : v * pow10[scale];
+		value = negative ? -v : v;
+		return true;
+	}
+	string text(b, e);
+	value = strtod(text.c_str(), nullptr);
+	return true;
+}
+
+int run_csv(const cli_options& opt) {
+	tokenizer tk(opt.expr);
+	tk.parse();
+	if (tk.error_state()) {
+		cerr << "-- parsing error -- in --expr\n";
+		return 1;
+	}
+	// one program for all rows
+	compile_options copt = opt.compile;
+	copt.fold_constants = true;
+	eval ev(tk, copt);
+	ev.compile();
+	if (ev.error_state()) {
+		cerr << "-- error -- in --expr\n";
+		return 1;
+	}
+	program prog = ev.get_program();
+	mapped_file file;
+	if (not file.open(opt.csv_path)) {
+		cerr << "cannot open " << opt.csv_path << "\n";
+		return 1;
+	}
+	csv_reader csv(file.data(), file.size(), opt.delimiter);
+	vector<csv_field> fields;
+	if (not csv.next(fields)) {
+		cerr << opt.csv_path << ": no header\n";
+		return 1;
+	}
+	// bind variables to columns by header name
+	vector<size_t> column_of(prog.slots.size());
+	for (size_t s = 0; s < prog.slots.size(); ++s) {
+		size_t c = 0;
+		while (c < fields.size() && fields[c].text() != prog.slots[s]) ++c;
+		if (c == fields.size()) {
+			cerr << opt.csv_path << ": no column " << prog.slots[s] << "\n";
+			return 1;
+		}
+		column_of[s] = c;
+	}
+
+#ifdef _WIN32
+	if (opt.binary) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+	output_buffer out(stdout);
+	if (opt.binary) write_binary_header(out);
+	const size_t block_rows = 4096;
+	column_evaluator ce(prog);
+	vector<vector<double>> columns(prog.slots.size(), vector<double>(block_rows));
+	vector<const double*> column_ptrs;
+	for (const vector<double>& c : columns) column_ptrs.push_back(c.data());
+	vector<line_status> status(block_rows);
+	vector<double> results(block_rows);
+	bool more = true;
+	while (more) {
+		size_t rows = 0;
+		while (rows < block_rows && (more = csv.next(fields))) {
+			line_status st = line_status::ok;
+			if (fields.size() == 1 && fields[0].begin == fields[0].end)
+				st = line_status::blank;
+			for (size_t s = 0; s < column_of.size() && st == line_status::ok; ++s) {
+				double v = 0;
+				size_t c = column_of[s];
+				if (c >= fields.size() || not parse_number(fields[c].begin, fields[c].end, v))
+					st = line_status::error;
+				columns[s][rows] = v;
+			}
+			status[rows++] = st;
+		}
+		ce.run(column_ptrs.data(), rows, results.data());
+		for (size_t i = 0; i < rows; ++i) {
+			line_result r;
+			r.status = status[i];
+			r.value = results[i];
+			write_result(out, r, opt);
+		}
+	}
+	return 0;
+}
+
+int run_batch(const cli_options& opt) {
+	ios::sync_with_stdio(false);
+	cin.tie(nullptr);
+#ifdef _WIN32
+	if (opt.binary) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+	output_buffer out(stdout);
+	if (opt.binary) write_binary_header(out);
+	program_cache cache(opt.cache_bytes, opt.compile);
+	program_cache* shared = opt.cache_bytes > 0 ? &cache : nullptr;
+	program_file store(opt.compile);
+	if (not opt.cache_file.empty() && store.open(opt.cache_file)) cache.set_store(&store);
+	int status = 0;
+	if (opt.cells) status = run_batch_cells(opt, out, shared);
+	else if (opt.dedup) status = run_batch_dedup(opt, out, shared);
+	else if (opt.pipeline) status = run_batch_pipeline(opt, out, shared);
+	else if (opt.threads != 1) status = run_batch_parallel(opt, out, shared);
+	else {
+		line_reader in(stdin);
+		line_evaluator state(opt.compile, shared, opt.result_slots);
+		string line;
+		while (in.next(line))
+			write_result(out, state.evaluate(line), opt);
+	}
+	out.flush();
+	if (shared != nullptr && not opt.cache_file.empty() && cache.get_stats().misses > 0)
+		store.save(opt.cache_file, cache);
+	if (opt.cache_stats) cache.get_stats().print(cerr);
+	return status;
+}
+
+int main(int argc, char* argv[]) {
+	cli_options opt;
+	if (not parse_cli(argc, argv, opt)) {
+		print_usage();
+		return 1;
+	}
+	if (opt.opstats) {
+		print_opcode_stats();
+		return 0;
+	}
+	if (not opt.csv_path.empty()) return run_csv(opt);
+	if (opt.batch || (not opt.interactive && not stdin_is_terminal()))
+		return run_batch(opt);
+	cout << "Simple math expression evaulator v " << VERSION << "\n"
+		<<  "Unary + and - is not supported. Operations: + - * / \n"
+		<<  "Use (.) for decimal point, blank line to exit \n"
+		<<  "name = expr defines a cell that other lines read by name \n\n";
+	program_cache cache(opt.cache_bytes, opt.compile);
+	program_file store(opt.compile);
+	if (not opt.cache_file.empty() && store.open(opt.cache_file)) cache.set_store(&store);
+	line_evaluator state(opt.compile, opt.cache_bytes > 0 ? &cache : nullptr,
+		opt.result_slots);
+	cell_sheet sheet(opt.compile);
+	line_edit edits(opt.compile);
+	string line;
+	do {
+		cout << "(expr): ";
 		getline(cin, line);
 		string_strip(line);
 
 		if (not line.empty()) {
-			// we try to parse expression
-			tokenizer tk(line);
-			tk.parse();
-			if (tk.error_state()) {
+			// we try to parse and evaulate expression
+			line_result r;
+			if (not edits.evaluate(line, r)) r = evaluate_cell_line(sheet, state, line);
+			if (r.status == line_status::parse_error) {
 				cout << "-- parsing error --\n";
 				continue;
 			}
-			// we try to evaulate expression
-			eval ev(tk);
-			ev.solve();
-			if (ev.error_state()) {
+			if (r.status != line_status::ok) {
 				cout << "-- error --\n";
+				if (not sheet.cycles().empty()) {
+					cout << "-- cycle:";
+					for (const string& name : sheet.cycles()) cout << " " << name;
+					cout << " --\n";
+				}
 				continue;
 			}
-			else {
-				cout << "(result): " << ev.get_result() << endl;
-			}
-			// debug
-			//for (auto q : ev.get_tokens())
-			//	cout << "{ " << (int)q.type << " \'" << q.text << "\' " << q.number << " }" << endl;
+			char text[32];
+			size_t n = format_result(r, opt.precision, text);
+			cout << "(result): ";
+			cout.write(text, n) << endl;
 		}
 	} while (not line.empty());
+	if (opt.cache_bytes > 0 && not opt.cache_file.empty() && cache.get_stats().misses > 0)
+		store.save(opt.cache_file, cache);
+	state.flush_stats();
+	if (opt.cache_stats) cache.get_stats().print(cerr);
+	return 0;
 }
\ No newline at end of file
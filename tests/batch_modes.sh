@@ -0,0 +1,65 @@
+#!/bin/sh
+# --dedup and --share print what the plain batch mode prints, with one
+# or more threads, with or without the result cache, and with a table of
+# shared subexpressions that fills up.
+#
+#   make -C tests check
+
+se=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# repeated lines, blanks, errors, variables and integer overflow
+awk 'BEGIN {
+	srand(49)
+	for (i = 0; i < 30000; ++i) {
+		r = int(rand() * 10)
+		if (r < 4) print int(rand() * 50) " + " int(rand() * 50) " * 3"
+		else if (r < 6) print "(" int(rand() * 9) ".5 - 1) / " int(rand() * 4)
+		else if (r == 6) print ""
+		else if (r == 7) print "x * " int(rand() * 5)
+		else if (r == 8) print "9223372036854775807 + " int(rand() * 3)
+		else print "((1+2)*" int(rand() * 1000) ")"
+	}
+}' > "$dir/in.txt"
+
+# long bracket groups shared between lines, nested, with overflow and
+# division by zero inside
+awk 'BEGIN {
+	srand(50)
+	for (g = 0; g < 40; ++g) {
+		group[g] = "(" g " * 1000003 + " g ".25 / 7 - 11 * 13)"
+		if (g % 5 == 0) group[g] = "(" group[g] " * 3037000500 * 3037000500)"
+		if (g % 7 == 0) group[g] = "(" group[g] " / (" g " - " g "))"
+	}
+	for (i = 0; i < 20000; ++i) {
+		a = group[int(rand() * 40)]
+		b = group[int(rand() * 40)]
+		r = int(rand() * 5)
+		if (r == 0) print a " + " b " * " i
+		else if (r == 1) print "(" a " - " b ") / " (i % 9)
+		else if (r == 2) print "((" a " * 2) + (" b " + " a "))"
+		else if (r == 3) print a " * y + " b
+		else print "((" i " * 7 + " i ".5 / 3 - 1) * (" i " + 12345678)) - " a
+	}
+}' >> "$dir/in.txt"
+
+"$se" --batch < "$dir/in.txt" > "$dir/expected.txt" || exit 1
+failed=0
+check() {
+	"$se" --batch "$@" < "$dir/in.txt" > "$dir/out.txt"
+	if ! cmp -s "$dir/expected.txt" "$dir/out.txt"; then
+		echo "different output: $*"
+		failed=1
+	fi
+}
+check --dedup
+check --dedup --threads 1
+check --dedup --threads 4
+check --dedup --result-cache 0 --cache-size 0
+check --share 64
+check --share 64 --threads 4
+check --share 1 --threads 3
+check --share 64 --cache-size 0 --result-cache 0
+[ $failed -eq 0 ] && echo ok
+exit $failed
@@ -0,0 +1,108 @@
+#!/bin/sh
+# --cache-file: a second run decodes every shape from the file and prints
+# what a run without the file prints; a damaged, truncated, empty or
+# foreign file changes no result, and the next run that compiles writes
+# a file that serves every shape again.
+#
+#   make -C tests check
+
+se=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# many shapes: integer and decimal literals, variables, errors, integer
+# overflow and long lines
+awk 'BEGIN {
+	srand(44)
+	split("+ - * /", ops, " ")
+	for (i = 0; i < 6000; ++i) {
+		n = 1 + int(rand() * 6)
+		s = ""
+		for (j = 0; j < n; ++j) {
+			r = int(rand() * 6)
+			if (r == 0) t = int(rand() * 100)
+			else if (r == 1) t = int(rand() * 100) "." int(rand() * 100)
+			else if (r == 2) t = "x"
+			else if (r == 3) t = "(" int(rand() * 9) " " ops[1 + int(rand() * 4)] " " int(rand() * 9) ".5)"
+			else if (r == 4) t = "3037000500"
+			else t = "(" int(rand() * 9) " - " int(rand() * 9) ")"
+			s = s (j > 0 ? " " ops[1 + int(rand() * 4)] " " : "") t
+		}
+		print s
+		if (i % 500 == 0) {
+			s = "1"
+			for (j = 0; j < 60; ++j) s = s " + " j " * " (j % 7) ".25 * x"
+			print s
+		}
+	}
+}' > "$dir/in.txt"
+
+cache=$dir/programs.bin
+"$se" --batch < "$dir/in.txt" > "$dir/expected.txt" || exit 1
+failed=0
+# runs with the cache file, the output must be the expected one
+run() {
+	if ! "$se" --batch --cache-stats --cache-file "$cache" < "$dir/in.txt" \
+		> "$dir/out.txt" 2> "$dir/stats.txt"; then
+		echo "failed: $1"
+		failed=1
+	elif ! cmp -s "$dir/expected.txt" "$dir/out.txt"; then
+		echo "different output: $1"
+		failed=1
+	fi
+}
+# the last run compiled nothing and found programs in the file
+served() {
+	if ! grep -q " [1-9][0-9]* file hits, 0 misses" "$dir/stats.txt"; then
+		echo "not served from the file: $1"
+		cat "$dir/stats.txt"
+		failed=1
+	fi
+}
+
+run "first run"
+[ -s "$cache" ] || { echo "no cache file"; exit 1; }
+run "second run"
+served "second run"
+cp "$cache" "$dir/good.bin"
+cmp -s "$cache" "$dir/good.bin" || { echo "file rewritten without misses"; failed=1; }
+
+# one byte changed in the header, the table, records and the last record
+size=$(wc -c < "$dir/good.bin")
+for offset in 0 9 17 25 33 41 49 64 72 80 100 \
+	$((size / 3)) $((size / 2)) $((size * 3 / 4)) $((size - 9)) $((size - 1)); do
+	cp "$dir/good.bin" "$cache"
+	byte=$(od -An -tu1 -j "$offset" -N 1 "$cache" | tr -d ' ')
+	printf "\\$(printf %o $(((byte + 1) % 256)))" |
+		dd of="$cache" bs=1 seek="$offset" conv=notrunc 2> /dev/null
+	run "byte $offset changed"
+	run "byte $offset changed, next run"
+	served "byte $offset changed, next run"
+done
+
+# truncated, empty, foreign and missing files
+for case in truncated empty foreign missing; do
+	case $case in
+		truncated) head -c $((size / 2)) "$dir/good.bin" > "$cache" ;;
+		empty) : > "$cache" ;;
+		foreign) cp "$dir/in.txt" "$cache" ;;
+		missing) rm -f "$cache" ;;
+	esac
+	run "$case file"
+	run "$case file, next run"
+	served "$case file, next run"
+done
+
+# a file written with other compile options is not used
+cp "$dir/good.bin" "$cache"
+"$se" --batch --canonical < "$dir/in.txt" > "$dir/expected.txt"
+"$se" --batch --canonical --cache-stats --cache-file "$cache" < "$dir/in.txt" \
+	> "$dir/out.txt" 2> "$dir/stats.txt"
+cmp -s "$dir/expected.txt" "$dir/out.txt" || { echo "different output: other options"; failed=1; }
+if grep -q " [1-9][0-9]* file hits" "$dir/stats.txt"; then
+	echo "file of other options used"
+	failed=1
+fi
+
+[ $failed -eq 0 ] && echo ok
+exit $failed
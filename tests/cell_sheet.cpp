@@ -0,0 +1,130 @@
+// ISO C++14 Standard
+//
+// cell_sheet: definitions only mark cells dirty, reads recompute the
+// dirty cells upstream of what they read and nothing else. Levels are
+// computed inputs first (big ones on the pool), and cycles are reported
+// by name while the rest of the cone still gets its values.
+//
+//   make -C tests check
+
+#define main simple_eval_main
+#include "../main.cpp"
+#undef main
+
+namespace {
+
+int failed = 0;
+
+void expect(const char* what, bool ok) {
+	if (ok) return;
+	cout << "failed: " << what << "\n";
+	++failed;
+}
+
+bool value_is(cell_sheet& sheet, const string& name, double value) {
+	line_result r = sheet.get(name);
+	return r.status == line_status::ok && r.value == value;
+}
+
+void dirty_marking() {
+	cell_sheet sheet;
+	sheet.define("a", "1");
+	sheet.define("b", "a+1");
+	sheet.define("c", "b*2");
+	sheet.define("d", "5");
+	expect("definitions compute nothing", sheet.computed_cells() == 0);
+	expect("c reads b reads a", value_is(sheet, "c", 4));
+	expect("a read computes its cone", sheet.computed_cells() == 3);
+	expect("clean cells are not recomputed", value_is(sheet, "c", 4) &&
+		sheet.computed_cells() == 3);
+	sheet.define("a", "10");
+	expect("cells off the cone stay clean", value_is(sheet, "d", 5) &&
+		sheet.computed_cells() == 4);
+	expect("a change recomputes downstream", value_is(sheet, "c", 22) &&
+		sheet.computed_cells() == 7);
+	sheet.define("c", "b*3");
+	expect("only the redefined cell", value_is(sheet, "c", 33) &&
+		sheet.computed_cells() == 8);
+	expect("bad formula is rejected", sheet.define("c", "b*") != line_status::ok &&
+		value_is(sheet, "c", 33));
+	sheet.define("e", "nothing+1");
+	expect("undefined input is an error", sheet.get("e").status == line_status::error);
+	sheet.define("nothing", "2");
+	expect("defining the input fixes the reader", value_is(sheet, "e", 3));
+	line_result r = sheet.evaluate("a+b+c");
+	expect("expressions read cells", r.status == line_status::ok && r.value == 54);
+}
+
+void level_order() {
+	// a diamond and a chain below one root
+	cell_sheet sheet;
+	sheet.define("top", "left*right+chain3");
+	sheet.define("left", "base+1");
+	sheet.define("right", "base*2");
+	sheet.define("base", "3");
+	sheet.define("chain3", "chain2+1");
+	sheet.define("chain2", "chain1+1");
+	sheet.define("chain1", "base");
+	expect("diamond and chain", value_is(sheet, "top", 4 * 6 + 5));
+	// a level far above parallel_cells, every cell checked
+	const int n = 5000;
+	sheet.define("x", "2");
+	string sum = "0";
+	for (int i = 0; i < n; ++i) {
+		string name = "f" + to_string(i);
+		sheet.define(name, "x*" + to_string(i) + "+1/3");
+		sheet.define("g" + to_string(i), name + "*" + name);
+		if (i % 100 == 0) sum += "+g" + to_string(i);
+	}
+	sheet.define("total", sum);
+	vector<string> names{ "total" };
+	for (int i = 0; i < n; ++i) names.push_back("g" + to_string(i));
+	vector<line_result> results = sheet.get(names);
+	bool all = true;
+	double total = 0;
+	for (int i = 0; i < n; ++i) {
+		double f = 2.0 * i + 1.0 / 3;
+		all = all && results[i + 1].status == line_status::ok && results[i + 1].value == f * f;
+		if (i % 100 == 0) total = total + f * f;
+	}
+	expect("parallel level", all);
+	expect("sum over the level", results[0].status == line_status::ok &&
+		results[0].value == total);
+	size_t before = sheet.computed_cells();
+	sheet.define("x", "3");
+	expect("one input changes its cone", value_is(sheet, "g7", (21 + 1.0 / 3) * (21 + 1.0 / 3)) &&
+		sheet.computed_cells() == before + 3);
+}
+
+void cycles() {
+	cell_sheet sheet;
+	sheet.define("one", "1");
+	sheet.define("p", "q+1");
+	sheet.define("q", "r*2");
+	sheet.define("r", "p");
+	sheet.define("tail", "r+one");
+	sheet.define("free", "one+1");
+	vector<line_result> results = sheet.get(vector<string>{ "tail", "free" });
+	vector<string> names = sheet.cycles();
+	sort(names.begin(), names.end());
+	expect("cells on the cycle", names == vector<string>{ "p", "q", "r" });
+	expect("cells behind the cycle are errors", results[0].status == line_status::error);
+	expect("cells off the cycle get values", results[1].status == line_status::ok &&
+		results[1].value == 2);
+	sheet.define("r", "5");
+	expect("broken cycle", value_is(sheet, "tail", 6) && value_is(sheet, "p", 11) &&
+		sheet.cycles().empty());
+	sheet.define("self", "self+1");
+	expect("self reference", sheet.get("self").status == line_status::error &&
+		sheet.cycles() == vector<string>{ "self" });
+}
+
+} // namespace
+
+int main() {
+	dirty_marking();
+	level_order();
+	cycles();
+	cout << (failed == 0 ? "ok" : "FAILED") << "\n";
+	return failed == 0 ? 0 : 1;
+}
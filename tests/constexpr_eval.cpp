@@ -0,0 +1,64 @@
+// ISO C++14 Standard
+//
+// constexpr_eval.h: constant evaluations checked at compile time, and the
+// same function run on expression text compared bit for bit with the
+// double path of tokenizer / eval, correctly rounded literals included.
+//
+//   make -C tests check
+
+#define main simple_eval_main
+#include "../main.cpp"
+#undef main
+
+#include "../constexpr_eval.h"
+
+#include <cstring>
+
+static_assert(simple_eval::evaluate("(1+2)*3/4") == 2.25, "constexpr_eval.h");
+static_assert(simple_eval::evaluate("1+2*3*4") == 25, "constexpr_eval.h");
+static_assert(simple_eval::evaluate(" 1 0 + 0.5 ") == 10.5, "blanks are ignored");
+static_assert(simple_eval::evaluate("0.1+0.2") == 0.1 + 0.2, "constexpr_eval.h");
+static_assert(simple_eval::evaluate("1.5.5") == 1.5, "atof stops at the second dot");
+
+namespace {
+
+unsigned long long bits(double d) {
+	unsigned long long u;
+	memcpy(&u, &d, sizeof u);
+	return u;
+}
+
+} // namespace
+
+int main() {
+	const vector<string> texts{
+		"(1+2)*3/4", "1+2*3*4-0.1/0.3", "0.1*3", "1/3+1/7", "10/4/2", "8-3-2",
+		"123456789012345678901234567890", "0.000000000000000000000123456789",
+		"9007199254740993.0", "2.2250738585072011", "1.7976931348623157*2",
+		"0.1000000000000000055511151231257827", "3.14159265358979323846264338327950288",
+		"((1.5+2.25)*(3.125-0.0625))/7.75", "4.35*100", "1.0000000000000002-1",
+	};
+	compile_options doubles;
+	doubles.integer = false;
+	int failed = 0;
+	for (const string& text : texts) {
+		double expected = simple_eval::evaluate(text.c_str());
+		tokenizer tk(text);
+		tk.parse();
+		eval ev(tk, doubles);
+		ev.compile();
+		if (not tk.error_state() && not ev.error_state()) ev.solve();
+		if (tk.error_state() || ev.error_state()) {
+			cout << "error: " << text << "\n";
+			++failed;
+			continue;
+		}
+		if (bits(ev.get_result()) != bits(expected)) {
+			cout.precision(17);
+			cout << expected << " != " << ev.get_result() << ": " << text << "\n";
+			++failed;
+		}
+	}
+	cout << (failed == 0 ? "ok" : "FAILED") << "\n";
+	return failed == 0 ? 0 : 1;
+}
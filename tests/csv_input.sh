@@ -0,0 +1,28 @@
+#!/bin/sh
+# --csv and --tsv over fixtures: quoted fields with "" escapes and
+# delimiters, long fields (the 16 byte field search), padded, signed,
+# exponent, long and subnormal numbers, empty and missing fields, a
+# blank row, a CRLF row and no new line at the end.
+#
+#   make -C tests check
+
+se=$1
+data=$(dirname "$0")/data
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+
+failed=0
+check() {
+	expected=$1
+	shift
+	"$se" "$@" > "$out"
+	if ! cmp -s "$expected" "$out"; then
+		echo "different output: $*"
+		diff "$expected" "$out"
+		failed=1
+	fi
+}
+check "$data/fixture.csv.expected" --csv "$data/fixture.csv" --expr "price*qty+fee"
+check "$data/fixture.tsv.expected" --tsv "$data/fixture.tsv" --expr "a*b-a"
+[ $failed -eq 0 ] && echo ok
+exit $failed
@@ -0,0 +1,151 @@
+// ISO C++14 Standard
+//
+// Differential test of expr_template.h: every formula is evaluated by the
+// templates and by tokenizer / eval::solve() from its text, with random
+// literals and variable values, and the results must have the same bits.
+// The double path of eval must always agree; the default options must
+// agree for programs that do not take the exact integer path. Needs
+// -ffp-contract=off, see expr_template.h.
+//
+//   make -C tests check
+
+#define main simple_eval_main
+#include "../main.cpp"
+#undef main
+
+#include "../constexpr_eval.h"
+#include "../expr_template.h"
+
+#include <cstring>
+#include <functional>
+#include <random>
+
+using namespace simple_eval::et;
+
+// the templates build the trees of the runtime grammar at compile time
+static_assert(((lit(1) + 2) * 3 / 4).eval() == simple_eval::evaluate("(1+2)*3/4"),
+	"expr_template.h");
+static_assert((1 + lit(2) * 3 * 4 - 0.1 / 0.3).eval() ==
+	simple_eval::evaluate("1+2*3*4-0.1/0.3"), "expr_template.h");
+
+namespace {
+
+unsigned long long bits(double d) {
+	unsigned long long u;
+	memcpy(&u, &d, sizeof u);
+	return u;
+}
+
+class formula {
+public:
+	// text with a b c d for the literals, x y for the variables
+	string text;
+	function<double(const double* k, const double* values)> templates;
+};
+
+// the literals a b c d become number text
+string substitute(const string& text, const vector<string>& k) {
+	string s;
+	for (char c : text) {
+		if (c >= 'a' && c <= 'd') s += k[c - 'a'];
+		else s += c;
+	}
+	return s;
+}
+
+string random_literal(mt19937& rng) {
+	uniform_int_distribution<int> kind(0, 5), digits(0, 999999);
+	switch (kind(rng)) {
+		case 0: return to_string(digits(rng) % 20);
+		case 1: return "0.0";
+		case 2: return "0." + to_string(digits(rng) % 10);
+		case 3: return to_string(digits(rng)) + "." + to_string(digits(rng));
+		case 4: return "0.000" + to_string(digits(rng));
+		default: return to_string(digits(rng) % 100) + "." + to_string(digits(rng));
+	}
+}
+
+// result of eval::solve() for the text, false on errors
+bool solve(const string& text, const compile_options& opt, double x, double y,
+	double& result, bool& integer) {
+	tokenizer tk(text);
+	tk.parse();
+	if (tk.error_state()) return false;
+	eval ev(tk, opt);
+	ev.compile();
+	if (ev.error_state()) return false;
+	const program& p = ev.get_program();
+	vector<double> values;
+	for (const string& s : p.slots) values.push_back(s == "x" ? x : y);
+	ev.solve(values.data());
+	if (ev.error_state()) return false;
+	result = ev.get_result();
+	integer = ev.is_integer();
+	return true;
+}
+
+} // namespace
+
+int main() {
+	const vector<formula> formulas{
+		{ "(a+b)*c/d", [](const double* k, const double*) {
+			return ((lit(k[0]) + k[1]) * k[2] / k[3]).eval(); } },
+		{ "a+b*c*d-a/b", [](const double* k, const double*) {
+			return (k[0] + lit(k[1]) * k[2] * k[3] - lit(k[0]) / k[1]).eval(); } },
+		{ "a-(b-(c-d))", [](const double* k, const double*) {
+			return (k[0] - (k[1] - (k[2] - lit(k[3])))).eval(); } },
+		{ "a/b/c/d", [](const double* k, const double*) {
+			return (lit(k[0]) / k[1] / k[2] / k[3]).eval(); } },
+		{ "(a*b+c*d)/(a-d)", [](const double* k, const double*) {
+			return ((lit(k[0]) * k[1] + lit(k[2]) * k[3]) / (lit(k[0]) - k[3])).eval(); } },
+		{ "a*b-c*d", [](const double* k, const double*) {
+			return (lit(k[0]) * k[1] - lit(k[2]) * k[3]).eval(); } },
+		{ "a*(b-c)", [](const double* k, const double*) {
+			return (k[0] * (lit(k[1]) - k[2])).eval(); } },
+		{ "a+b+c+d", [](const double* k, const double*) {
+			return (lit(k[0]) + k[1] + k[2] + k[3]).eval(); } },
+		{ "x*a+y/b-x", [](const double* k, const double* v) {
+			return (var(0) * k[0] + var(1) / k[1] - var(0)).eval(v); } },
+		{ "(x+y)*(x-c)", [](const double* k, const double* v) {
+			return ((var(0) + var(1)) * (var(0) - k[2])).eval(v); } },
+		{ "y/(a-x*b)+d", [](const double* k, const double* v) {
+			return (var(1) / (k[0] - var(0) * k[1]) + k[3]).eval(v); } },
+	};
+	mt19937 rng(28);
+	uniform_real_distribution<double> value(-100, 100);
+	compile_options doubles;
+	doubles.integer = false;
+	compile_options defaults;
+	int failed = 0, checked = 0;
+	for (const formula& f : formulas)
+		for (int i = 0; i < 5000; ++i) {
+			vector<string> text(4);
+			double k[4];
+			for (int j = 0; j < 4; ++j) {
+				text[j] = random_literal(rng);
+				k[j] = strtod(text[j].c_str(), nullptr);
+			}
+			// slot order of the templates: x, y
+			double v[2] = { value(rng), i % 7 == 0 ? 0.0 : value(rng) };
+			string expr = substitute(f.text, text);
+			double expected = f.templates(k, v);
+			for (const compile_options* opt : { &doubles, &defaults }) {
+				double result{};
+				bool integer{};
+				if (not solve(expr, *opt, v[0], v[1], result, integer)) {
+					cout << "error: " << expr << "\n";
+					++failed;
+					continue;
+				}
+				if (opt == &defaults && integer) continue;
+				++checked;
+				if (bits(result) != bits(expected)) {
+					cout.precision(17);
+					cout << expected << " != " << result << ": " << expr << "\n";
+					++failed;
+				}
+			}
+		}
+	cout << checked << " checked, " << (failed == 0 ? "ok" : "FAILED") << "\n";
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+// ISO C++14 Standard
+//
+// line_edit: random edits of random expressions (digits changed,
+// characters inserted and erased, operators swapped), every line
+// evaluated incrementally and by a full evaluation. Results must be
+// equal, and lines without variables must not fall back to the full
+// path. A one digit edit of a long line must relex only a few tokens.
+//
+//   make -C tests check
+
+#define main simple_eval_main
+#include "../main.cpp"
+#undef main
+
+#include <random>
+
+namespace {
+
+mt19937_64 rng(48);
+
+string random_expression(int depth) {
+	if (depth == 0 || rng() % 10 < 3) {
+		switch (rng() % 5) {
+			case 0: return to_string(rng() % 1000000007 * (rng() % 100000));
+			case 1: return to_string(rng() % 100) + "." + to_string(rng() % 100);
+			case 2: return to_string(rng() % 20) + " " + to_string(rng() % 10);
+			default: return to_string(rng() % 20);
+		}
+	}
+	const char* ops = "+-*/+*";
+	string blank = rng() % 3 == 0 ? " " : "";
+	return "(" + random_expression(depth - 1) + blank + ops[rng() % 6] + blank +
+		random_expression(depth - 1) + ")";
+}
+
+bool same(const line_result& a, const line_result& b) {
+	if (a.status != b.status) return false;
+	if (a.status != line_status::ok) return true;
+	return a.integer == b.integer && (not a.integer || a.integer_value == b.integer_value) &&
+		(memcmp(&a.value, &b.value, sizeof a.value) == 0 || (a.value != a.value && b.value != b.value));
+}
+
+void edit(string& line) {
+	const char* alpha = "0123456789.+-*/() x";
+	size_t pos = rng() % (line.size() + 1);
+	switch (rng() % 4) {
+		case 0:
+			if (pos < line.size()) line.erase(pos, 1 + rng() % 3);
+			break;
+		case 1:
+			line.insert(pos, 1, alpha[rng() % 19]);
+			break;
+		default:
+			if (pos >= line.size()) break;
+			if (isdigit((unsigned char)line[pos])) line[pos] = (char)('0' + rng() % 10);
+			else if (rng() % 2) line[pos] = "+-*/"[rng() % 4];
+			break;
+	}
+	if (rng() % 50 == 0) line = random_expression(4);
+}
+
+} // namespace
+
+int main() {
+	int failed = 0;
+	size_t total = 0, incremental = 0;
+	for (int round = 0; round < 200; ++round) {
+		compile_options opt;
+		opt.integer = round % 4 != 0;
+		line_edit edits(opt);
+		line_evaluator full(opt, nullptr, 0);
+		string line = random_expression(2 + rng() % 6);
+		for (int step = 0; step < 200; ++step, edit(line)) {
+			string text = line;
+			string_strip(text);
+			if (text.empty()) {
+				line = random_expression(3);
+				continue;
+			}
+			string copy = text;
+			line_result expected = full.evaluate(copy), r;
+			++total;
+			if (edits.evaluate(text, r)) {
+				++incremental;
+				if (same(r, expected)) continue;
+				cout.precision(17);
+				cout << "different: " << text << ": " << r.value << " != " << expected.value << "\n";
+				++failed;
+			}
+			else if (expected.status == line_status::ok && text.find('x') == string::npos) {
+				cout << "full path: " << text << "\n";
+				++failed;
+			}
+		}
+	}
+	// a long line: one changed digit relexes its neighbourhood only
+	string line = "1";
+	for (int i = 0; i < 2000; ++i) line += (i % 2 ? "*" : "+") + to_string(i % 97 + 1);
+	line_edit edits;
+	line_result r;
+	edits.evaluate(line, r);
+	size_t mid = line.find_first_of("0123456789", line.size() / 2);
+	line[mid] = line[mid] == '7' ? '8' : '7';
+	if (not edits.evaluate(line, r) || edits.relexed_chars() > 32) {
+		cout << "one digit relexed " << edits.relexed_chars() << " characters\n";
+		++failed;
+	}
+	cout << total << " lines, " << incremental << " incremental, "
+		<< (failed == 0 ? "ok" : "FAILED") << "\n";
+	return failed == 0 ? 0 : 1;
+}
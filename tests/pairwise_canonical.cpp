@@ -0,0 +1,83 @@
+// ISO C++14 Standard
+//
+// --pairwise gives the same results with and without --canonical: the
+// canonical operand order must not move the chains that pairwise
+// reduction finds.
+//
+//   make -C tests check
+
+#define main simple_eval_main
+#include "../main.cpp"
+#undef main
+
+#include <cstring>
+#include <random>
+
+namespace {
+
+unsigned long long bits(double d) {
+	unsigned long long u;
+	memcpy(&u, &d, sizeof u);
+	return u;
+}
+
+// long + chains with products, bracketed sums and variables as terms
+string random_chain(mt19937& rng) {
+	uniform_int_distribution<int> length(8, 80), kind(0, 5), digits(0, 999999);
+	auto number = [&] { return to_string(digits(rng) % 100) + "." + to_string(digits(rng)); };
+	string s;
+	int n = length(rng);
+	for (int i = 0; i < n; ++i) {
+		if (i > 0) s += '+';
+		switch (kind(rng)) {
+			case 0: s += "(" + number() + "*" + number() + ")"; break;
+			case 1: s += "(" + number() + "+" + number() + "+" + number() + ")"; break;
+			case 2: s += "x"; break;
+			case 3: s += "y*" + number(); break;
+			default: s += number(); break;
+		}
+	}
+	return s;
+}
+
+bool run(const string& text, const compile_options& opt, double& result) {
+	tokenizer tk(text);
+	tk.parse();
+	if (tk.error_state()) return false;
+	eval ev(tk, opt);
+	ev.compile();
+	if (ev.error_state()) return false;
+	const program& p = ev.get_program();
+	vector<double> values;
+	for (const string& s : p.slots) values.push_back(s == "x" ? 0.1 : 1.0 / 3);
+	ev.solve(values.data());
+	if (ev.error_state()) return false;
+	result = ev.get_result();
+	return true;
+}
+
+} // namespace
+
+int main() {
+	mt19937 rng(2024);
+	compile_options pairwise;
+	pairwise.pairwise_terms = 4;
+	compile_options canonical = pairwise;
+	canonical.canonical = true;
+	int failed = 0;
+	for (int i = 0; i < 2000; ++i) {
+		string text = random_chain(rng);
+		double a{}, b{};
+		if (not run(text, pairwise, a) || not run(text, canonical, b)) {
+			cout << "error: " << text << "\n";
+			++failed;
+		}
+		else if (bits(a) != bits(b)) {
+			cout.precision(17);
+			cout << a << " != " << b << ": " << text << "\n";
+			++failed;
+		}
+	}
+	cout << (failed == 0 ? "ok" : "FAILED") << "\n";
+	return failed == 0 ? 0 : 1;
+}
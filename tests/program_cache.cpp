@@ -0,0 +1,56 @@
+// ISO C++14 Standard
+//
+// program_cache shares programs between lines of one shape, so it must
+// not fold constants: options with fold_constants still give the value
+// of every line, and the cache file fingerprint ignores the option.
+//
+//   make -C tests check
+
+#define main simple_eval_main
+#include "../main.cpp"
+#undef main
+
+namespace {
+
+int failed = 0;
+
+void expect(const string& text, double value, line_result r) {
+	if (r.status == line_status::ok && r.value == value) return;
+	cout.precision(17);
+	cout << text << ": expected " << value << ", got " << r.value
+		<< " (status " << (int)r.status << ")\n";
+	++failed;
+}
+
+} // namespace
+
+int main() {
+	compile_options folding;
+	folding.fold_constants = true;
+	program_cache cache(1 << 20, folding);
+	line_evaluator state(folding, &cache, 0);
+	const vector<pair<string, double>> lines{
+		{ "1+2", 3 }, { "3+4", 7 }, { "1.5*2+1", 4 }, { "2.5*2+1", 6 },
+		{ "(1+2)*(3+4)", 21 }, { "(5+6)*(7+8)", 165 }, { "1+2", 3 },
+	};
+	for (const auto& l : lines) {
+		string line = l.first;
+		expect(l.first, l.second, state.evaluate(line));
+	}
+	// program_cache::get() compiles with the options of the cache
+	for (const auto& l : lines) {
+		prepared_expression expr;
+		if (not cache.get(l.first, expr)) {
+			cout << l.first << ": not compiled\n";
+			++failed;
+			continue;
+		}
+		expect(l.first, l.second, run_program(*expr.prog, &expr.literals));
+	}
+	if (options_fingerprint(folding) != options_fingerprint(compile_options{})) {
+		cout << "fold_constants changes the cache file fingerprint\n";
+		++failed;
+	}
+	cout << (failed == 0 ? "ok" : "FAILED") << "\n";
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+// ISO C++14 Standard
+//
+// format_shortest(): every text reads back to the same bits and no text
+// with fewer significant digits does, for random doubles, subnormals,
+// powers of ten and of two and their neighbours. At the length of the
+// shortest correctly rounded %.*e text the digits must be the same.
+//
+//   make -C tests check
+
+#define main simple_eval_main
+#include "../main.cpp"
+#undef main
+
+#include <cfloat>
+#include <random>
+
+namespace {
+
+unsigned long long bits(double d) {
+	unsigned long long u;
+	memcpy(&u, &d, sizeof u);
+	return u;
+}
+
+double from_bits(unsigned long long u) {
+	double d;
+	memcpy(&d, &u, sizeof d);
+	return d;
+}
+
+// significant digits of a number text, without sign, point and exponent
+string significant(const string& text) {
+	string d;
+	for (char c : text) {
+		if (c == 'e') break;
+		if (c >= '0' && c <= '9') d += c;
+	}
+	size_t first = d.find_first_not_of('0');
+	if (first == string::npos) return "0";
+	d.erase(0, first);
+	while (d.size() > 1 && d.back() == '0') d.pop_back();
+	return d;
+}
+
+// digits of the shortest correctly rounded %.*e text that reads back;
+// a shorter text that is not correctly rounded may read back too
+string reference(double v) {
+	char text[40];
+	for (int precision = 1; precision <= 17; ++precision) {
+		snprintf(text, sizeof(text), "%.*e", precision - 1, v);
+		if (strtod(text, nullptr) == v) break;
+	}
+	return significant(text);
+}
+
+// some text of n significant digits reads back to v: the candidates
+// are the two n digit decimals around v, next to the rounded one
+bool reads_back(double v, int n) {
+	char text[40];
+	snprintf(text, sizeof(text), "%.*e", n - 1, v);
+	unsigned long long digits = 0;
+	const char* p = text;
+	for (; *p != 'e'; ++p)
+		if (*p != '.') digits = digits * 10 + (unsigned long long)(*p - '0');
+	int e = atoi(p + 1) - (n - 1);
+	for (unsigned long long d : { digits - 1, digits, digits + 1 }) {
+		snprintf(text, sizeof(text), "%llue%d", d, e);
+		if (strtod(text, nullptr) == v) return true;
+	}
+	return false;
+}
+
+int failed = 0;
+
+void check(double v) {
+	char text[32];
+	size_t n = format_shortest(v, text);
+	string s(text, n);
+	if (v != v) {
+		// no payloads in text
+		if (s == "nan") return;
+		cout << "nan printed as " << s << "\n";
+		++failed;
+		return;
+	}
+	if (n >= 32 || bits(strtod(s.c_str(), nullptr)) != bits(v)) {
+		cout << "round trip: " << s << " for bits " << hex << bits(v) << dec << "\n";
+		++failed;
+		return;
+	}
+	if (isinf(v)) return;
+	// as short as the rounded text and equal to it, or shorter and
+	// then nothing shorter reads back
+	string digits = significant(s), rounded = reference(fabs(v));
+	if (digits.size() > rounded.size() || (digits.size() == rounded.size() &&
+		digits != rounded) || (digits.size() > 1 && reads_back(fabs(v), (int)digits.size() - 1))) {
+		cout << "not shortest: " << s << ", rounded digits " << rounded << "\n";
+		++failed;
+	}
+}
+
+} // namespace
+
+int main() {
+	const vector<double> special{ 0.0, -0.0, 1.0, -1.0, 0.1, 0.2, 0.3, 1.0 / 3,
+		5e-324, -5e-324, DBL_MIN, DBL_MAX, -DBL_MAX, DBL_EPSILON, 1e21, 1e22, 1e23,
+		9007199254740993.0, 123456789012345678.0, 1e-6, 1e-7, 0.000001234,
+		HUGE_VAL, -HUGE_VAL, nan(""), 2.2250738585072009e-308, 4.9406564584124654e-324 };
+	for (double v : special) check(v);
+	for (int e = -323; e <= 308; ++e) {
+		double p = strtod(("1e" + to_string(e)).c_str(), nullptr);
+		check(p);
+		check(nextafter(p, 0.0));
+		check(nextafter(p, HUGE_VAL));
+	}
+	for (int e = -1074; e <= 1023; ++e) check(ldexp(1.0, e));
+	mt19937_64 rng(36);
+	for (int i = 0; i < 100000; ++i) {
+		unsigned long long u = rng();
+		// every fifth a subnormal
+		if (i % 5 == 0) u &= 0x800fffffffffffffULL;
+		check(from_bits(u));
+	}
+	for (int i = 0; i < 100000; ++i) check((double)(rng() % 1000000) / 1000);
+	cout << (failed == 0 ? "ok" : "FAILED") << "\n";
+	return failed == 0 ? 0 : 1;
+}